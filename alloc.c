@@ -22,6 +22,7 @@ THE SOFTWARE.
 
 #include "alloc.h"
 #include <assert.h>
+#include "env.h"
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,6 +36,8 @@ THE SOFTWARE.
 // Block size for allocating internal data structures.
 #define ALLOC_BLOCKSIZE PAGESIZE
 
+#define HUGEPAGESIZE ((size_t)0x200000)
+
 typedef struct memory_metadata_t memory_metadata_t;
 
 /****************************************************************************/
@@ -80,6 +83,20 @@ static void *mmap_wrap (size_t size, int shared)
     return ptr;
 }
 
+/**
+ * Try to get hugetlb pages.  Return NULL, instead of failing, if the system
+ * doesn't have any to give.
+ */
+static void *mmap_hugetlb_wrap (size_t size, int shared)
+{
+    void *ptr = mmap(NULL, size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_HUGETLB
+                     | (shared ? MAP_SHARED : MAP_PRIVATE),
+                     -1, 0);
+    return MAP_FAILED == ptr ? NULL : ptr;
+}
+
 /**
  * Wrapper for munmap to be symetrical with mmap/mmap_wrap.
  */
@@ -242,13 +259,25 @@ static mem_range_t metadata_break_range (mem_range_t *big_range)
     return ret;
 }
 
-static void *alloc_mmap (size_t size, const char *reason, int shared)
+static void *alloc_mmap (size_t size, const char *reason, int shared, int huge)
 {
     memory_metadata_t *meta = metadata_new();
     assert(size % PAGESIZE == 0);
     assert(meta);
+    meta->addr = NULL;
+    if (huge && g_forkscan_huge_pages == HUGE_PAGES_HUGETLB) {
+        size_t huge_size = (size + HUGEPAGESIZE - 1) & ~(HUGEPAGESIZE - 1);
+        meta->addr = mmap_hugetlb_wrap(huge_size, shared);
+        if (meta->addr) size = huge_size;
+    }
+    if (NULL == meta->addr) {
+        meta->addr = mmap_wrap(size, shared);
+        if (huge && g_forkscan_huge_pages != HUGE_PAGES_NONE) {
+            // Not fatal if THP is unavailable.  It's just advice.
+            madvise(meta->addr, size, MADV_HUGEPAGE);
+        }
+    }
     meta->length = size;
-    meta->addr = mmap_wrap(size, shared);
     meta->reason = reason;
     assert(meta->addr && meta->addr != MAP_FAILED);
     metadata_insert(meta);
@@ -270,7 +299,7 @@ static void *alloc_mmap (size_t size, const char *reason, int shared)
  */
 void *forkscan_alloc_mmap (size_t size, const char *reason)
 {
-    return alloc_mmap(size, reason, /*shared=*/0);
+    return alloc_mmap(size, reason, /*shared=*/0, /*huge=*/0);
 }
 
 /**
@@ -281,7 +310,44 @@ void *forkscan_alloc_mmap (size_t size, const char *reason)
  */
 void *forkscan_alloc_mmap_shared (size_t size, const char *reason)
 {
-    return alloc_mmap(size, reason, /*shared=*/1);
+    return alloc_mmap(size, reason, /*shared=*/1, /*huge=*/0);
+}
+
+/**
+ * Like forkscan_alloc_mmap(), but backed by huge pages if the user asked for
+ * them with FORKSCAN_HUGE_PAGES.  Falls back on regular pages.
+ */
+void *forkscan_alloc_mmap_huge (size_t size, const char *reason)
+{
+    return alloc_mmap(size, reason, /*shared=*/0, /*huge=*/1);
+}
+
+/**
+ * Like forkscan_alloc_mmap_shared(), but backed by huge pages if the user
+ * asked for them with FORKSCAN_HUGE_PAGES.  Falls back on regular pages.
+ */
+void *forkscan_alloc_mmap_shared_huge (size_t size, const char *reason)
+{
+    return alloc_mmap(size, reason, /*shared=*/1, /*huge=*/1);
+}
+
+/**
+ * Reserve address space, inaccessible until the caller mprotect()s pieces
+ * of it.  Like the rest of Forkscan's memory, it is never scanned.
+ * @return The reservation, or NULL if there isn't enough address space.
+ */
+void *forkscan_alloc_reserve (size_t size, const char *reason)
+{
+    void *ptr = mmap(NULL, size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == ptr) return NULL;
+
+    memory_metadata_t *meta = metadata_new();
+    meta->addr = ptr;
+    meta->length = size;
+    meta->reason = reason;
+    metadata_insert(meta);
+    return ptr;
 }
 
 /**
@@ -314,3 +380,23 @@ mem_range_t forkscan_alloc_next_subrange (mem_range_t *big_range)
 {
     return metadata_break_range(big_range);
 }
+
+/**
+ * Advise the kernel to back [low, high) with transparent huge pages,
+ * skipping any memory that belongs to Forkscan.  This is for the
+ * allocator's heap, which Forkscan doesn't map itself.  Unlike
+ * forkscan_alloc_next_subrange(), this is thread-safe.
+ */
+void forkscan_alloc_advise_heap (size_t low, size_t high)
+{
+    mem_range_t big_range = { PAGEALIGN(low), PAGEALIGN(high) };
+
+    pthread_mutex_lock(&list_lock);
+    while (big_range.low != big_range.high) {
+        mem_range_t next = metadata_break_range(&big_range);
+        if (next.high - next.low >= HUGEPAGESIZE) {
+            madvise((void*)next.low, next.high - next.low, MADV_HUGEPAGE);
+        }
+    }
+    pthread_mutex_unlock(&list_lock);
+}
@@ -54,6 +54,25 @@ void *forkscan_alloc_mmap (size_t size, const char *reason);
  */
 void *forkscan_alloc_mmap_shared (size_t size, const char *reason);
 
+/**
+ * Like forkscan_alloc_mmap(), but backed by huge pages if the user asked for
+ * them with FORKSCAN_HUGE_PAGES.  Falls back on regular pages.
+ */
+void *forkscan_alloc_mmap_huge (size_t size, const char *reason);
+
+/**
+ * Like forkscan_alloc_mmap_shared(), but backed by huge pages if the user
+ * asked for them with FORKSCAN_HUGE_PAGES.  Falls back on regular pages.
+ */
+void *forkscan_alloc_mmap_shared_huge (size_t size, const char *reason);
+
+/**
+ * Reserve address space, inaccessible until the caller mprotect()s pieces
+ * of it.  Like the rest of Forkscan's memory, it is never scanned.
+ * @return The reservation, or NULL if there isn't enough address space.
+ */
+void *forkscan_alloc_reserve (size_t size, const char *reason);
+
 /**
  * munmap() for the Forkscan system.
  */
@@ -70,4 +89,12 @@ void forkscan_alloc_munmap (void *ptr);
  */
 mem_range_t forkscan_alloc_next_subrange (mem_range_t *big_range);
 
+/**
+ * Advise the kernel to back [low, high) with transparent huge pages,
+ * skipping any memory that belongs to Forkscan.  This is for the
+ * allocator's heap, which Forkscan doesn't map itself.  Unlike
+ * forkscan_alloc_next_subrange(), this is thread-safe.
+ */
+void forkscan_alloc_advise_heap (size_t low, size_t high);
+
 #endif // !defined _ALLOC_H_
@@ -25,6 +25,7 @@ THE SOFTWARE.
 #include "buffer.h"
 #include "env.h"
 #include <pthread.h>
+#include <unistd.h>
 #include "util.h"
 
 #define STACKSIZE (2 * 1024 * 1024)
@@ -34,13 +35,39 @@ static int g_default_capacity;
 static pthread_mutex_t g_reclaimer_list_lock = PTHREAD_MUTEX_INITIALIZER;
 static addr_buffer_t *g_reclaimer_list;
 
-static addr_buffer_t *g_first_retiree_buffer;
-static addr_buffer_t *g_last_retiree_buffer;
+// Retiree buffers are published in a table of slots that free'ing threads
+// take references through.  A slot's word is the buffer's address, which is
+// page-aligned, with a reference count and a "retired" bit packed into the
+// low bits: one CAS both checks the buffer is still there and pins it.
+#define RETIREE_SLOTS 64
+#define SLOT_REF_MASK ((size_t)0x7ff)
+#define SLOT_RETIRED ((size_t)0x800)
+#define SLOT_PTR_MASK (~(SLOT_REF_MASK | SLOT_RETIRED))
+
+typedef struct retiree_slot_t retiree_slot_t;
+
+struct retiree_slot_t {
+    volatile size_t word;
+} __attribute__((aligned(64)));
+
+static retiree_slot_t g_retiree_slots[RETIREE_SLOTS];
+static volatile int g_retiree_slot_hwm; // Slots that have ever been used.
+static volatile int g_n_retirees;       // Buffers not yet popped.
+
+// Buffers that found every slot busy, oldest first.
+static addr_buffer_t *volatile g_waiting_retirees;
 static pthread_mutex_t g_retiree_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static addr_buffer_t *g_available_aggregates;
 static pthread_mutex_t g_aa_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Only one reclamation iteration runs at a time, so one buffer of dead
+// references will do.
+static addr_buffer_t *g_dead_references;
+
+static spill_chunk_t *volatile g_spill_list;
+static volatile int g_spilled; // Pointer slots held by spill chunks.
+
 #include <stdio.h>
 addr_buffer_t *forkscan_make_reclaimer_buffer ()
 {
@@ -57,7 +84,6 @@ addr_buffer_t *forkscan_make_reclaimer_buffer ()
         g_reclaimer_list = ab->next;
         pthread_mutex_unlock(&g_reclaimer_list_lock);
         ab->n_addrs = 0;
-        assert(ab->ref_count == 0);
         return ab;
     }
 
@@ -65,16 +91,17 @@ addr_buffer_t *forkscan_make_reclaimer_buffer ()
         g_default_capacity = g_forkscan_ptrs_per_thread * MAX_THREAD_COUNT;
     }
     size_t sz = g_default_capacity * sizeof(size_t) + PAGESIZE;
-    char *raw_mem = forkscan_alloc_mmap(sz, "reclaimer");
+    char *raw_mem = forkscan_alloc_mmap_huge(sz, "reclaimer");
 
     //   0 - 4095: Reserved page for the addr_buffer_t struct.
     //   4096 -  : Address list.
     ab = (addr_buffer_t*)raw_mem;
     ab->addrs = (size_t*)&raw_mem[PAGESIZE];
+    ab->sizes = NULL;
+    ab->types = NULL;
     ab->n_addrs = 0;
     ab->capacity = g_default_capacity;
     ab->is_aggregate = 0;
-    ab->ref_count = 0;
 
     return ab;
 }
@@ -102,7 +129,6 @@ addr_buffer_t *forkscan_make_aggregate_buffer (int capacity)
             ab->next = NULL;
             pthread_mutex_unlock(&g_aa_mutex);
             ab->n_addrs = 0;
-            assert(ab->ref_count == 0);
             return ab;
         }
         // None of the available buffers were big enough, and all were
@@ -114,18 +140,26 @@ addr_buffer_t *forkscan_make_aggregate_buffer (int capacity)
     // How many pages of memory are needed to store this many addresses?
     size_t pages_of_addrs = ((capacity * sizeof(size_t))
                              + PAGESIZE - sizeof(size_t)) / PAGESIZE;
+    // How many pages of memory are needed to store the sizes?
+    size_t pages_of_sizes = ((capacity * sizeof(unsigned int))
+                             + PAGESIZE - sizeof(unsigned int)) / PAGESIZE;
+    // How many pages of memory are needed to store the types?
+    size_t pages_of_types = ((capacity * sizeof(unsigned short))
+                             + PAGESIZE - sizeof(unsigned short)) / PAGESIZE;
     // How many pages of memory are needed to store the minimap?
     size_t pages_of_minimap = ((pages_of_addrs * sizeof(size_t))
                                + PAGESIZE - sizeof(size_t)) / PAGESIZE;
-    // Total pages needed is the number of pages for the addresses, plus the
-    // number of pages needed for the minimap, plus one (for the
-    // addr_buffer_t).
-    char *p =
-        (char*)forkscan_alloc_mmap_shared((pages_of_addrs     // addr array.
-                                           + pages_of_minimap // minimap.
-                                           + 1)               // struct page.
-                                          * PAGESIZE,
-                                          "aggregate");
+    // Total pages needed is the number of pages for the addresses, their
+    // sizes and types, plus the number of pages needed for the minimap, plus
+    // one (for the addr_buffer_t).
+    char *p = (char*)
+        forkscan_alloc_mmap_shared_huge((pages_of_addrs     // addr array.
+                                         + pages_of_sizes   // size array.
+                                         + pages_of_types   // type array.
+                                         + pages_of_minimap // minimap.
+                                         + 1)               // struct page.
+                                        * PAGESIZE,
+                                        "aggregate");
 
     // Perform assignments as offsets into the block that was bulk-allocated.
     size_t offset = 0;
@@ -135,20 +169,23 @@ addr_buffer_t *forkscan_make_aggregate_buffer (int capacity)
     ab->addrs = (size_t*)(p + offset);
     offset += pages_of_addrs * PAGESIZE;
 
+    ab->sizes = (unsigned int*)(p + offset);
+    offset += pages_of_sizes * PAGESIZE;
+
+    ab->types = (unsigned short*)(p + offset);
+    offset += pages_of_types * PAGESIZE;
+
     ab->minimap = (size_t*)(p + offset);
     offset += pages_of_minimap * PAGESIZE;
 
     ab->capacity = capacity;
     ab->is_aggregate = 1;
-    ab->ref_count = 0;
 
     return ab;
 }
 
 void forkscan_release_buffer (addr_buffer_t *ab)
 {
-    assert(ab != g_first_retiree_buffer);
-    assert(ab != g_last_retiree_buffer);
     if (ab->is_aggregate == 0) {
         assert(ab->capacity == g_default_capacity);
         pthread_mutex_lock(&g_reclaimer_list_lock);
@@ -163,115 +200,337 @@ void forkscan_release_buffer (addr_buffer_t *ab)
     }
 }
 
+/**
+ * Split ab into shards for free'ing threads to claim ranges from: one per
+ * CPU, but never so many that a shard is shorter than a free range.
+ */
+static void make_shards (addr_buffer_t *ab)
+{
+    static int n_cpus;
+    int n, i;
+
+    if (0 == n_cpus) {
+        n_cpus = MAX_OF(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    n = ab->n_addrs / MAX_OF(1, g_forkscan_free_range);
+    n = MAX_OF(1, MIN_OF(n, MIN_OF(n_cpus, RETIREE_SHARDS)));
+    for (i = 0; i < n; ++i) {
+        ab->shards[i].next = (int)((long)ab->n_addrs * i / n);
+        ab->shards[i].end = (int)((long)ab->n_addrs * (i + 1) / n);
+    }
+    ab->n_shards = n;
+}
+
+/**
+ * Try to publish ab in an empty slot.  Safe to race with other publishers.
+ * @return 1 on success, zero if every slot is in use.
+ */
+static int publish (addr_buffer_t *ab)
+{
+    int i;
+
+    assert(0 == ((size_t)ab & ~SLOT_PTR_MASK));
+    for (i = 0; i < RETIREE_SLOTS; ++i) {
+        if (0 != g_retiree_slots[i].word) continue;
+        ab->slot = i;
+        if (BCAS(&g_retiree_slots[i].word, 0, (size_t)ab)) {
+            int hwm;
+            while ((hwm = g_retiree_slot_hwm) <= i) {
+                BCAS(&g_retiree_slot_hwm, hwm, i + 1);
+            }
+            return 1;
+        }
+    }
+    ab->slot = -1;
+    return 0;
+}
+
+/**
+ * Move waiting buffers into slots, oldest first, for as long as there are
+ * empty slots.  g_retiree_mutex must be held.
+ */
+static void publish_waiting ()
+{
+    while (g_waiting_retirees && publish(g_waiting_retirees)) {
+        g_waiting_retirees = g_waiting_retirees->next;
+    }
+}
+
+/**
+ * Hand the unreferenced nodes in ab over to the free'ing threads.  ab
+ * belongs to them, now, and is released once they are all done with it.
+ */
 void forkscan_buffer_push_back (addr_buffer_t *ab)
 {
-    ab->ref_count = 1;
-    ab->free_idx = 0;
+    if (0 == ab->n_addrs) {
+        // Nothing to free, and nobody would come along to pop it.
+        forkscan_release_buffer(ab);
+        return;
+    }
+    make_shards(ab);
     ab->next = NULL;
+    __sync_fetch_and_add(&g_n_retirees, 1);
+
+    if (NULL == g_waiting_retirees && publish(ab)) return;
 
+    // Every slot is busy.  Wait in line for one to open up.
     pthread_mutex_lock(&g_retiree_mutex);
-    if (NULL == g_last_retiree_buffer) {
-        g_last_retiree_buffer = g_first_retiree_buffer = ab;
+    if (NULL == g_waiting_retirees) {
+        g_waiting_retirees = ab;
     } else {
-        // FIXME: What if when the buff was removed from the list, it wasn't
-        // at the front?
-        g_last_retiree_buffer->next = ab;
-        g_last_retiree_buffer = ab;
+        addr_buffer_t *last = g_waiting_retirees;
+        while (last->next) last = last->next;
+        last->next = ab;
     }
+    publish_waiting();
     pthread_mutex_unlock(&g_retiree_mutex);
 }
 
+/**
+ * Take ab out of circulation: no thread will be handed it again.  The
+ * caller must hold a reference, which it then gives up as usual.
+ */
 void forkscan_buffer_pop_retiree_buffer (addr_buffer_t *ab)
 {
-    addr_buffer_t *curr, *prev = NULL;
-    pthread_mutex_lock(&g_retiree_mutex);
-    curr = g_first_retiree_buffer;
-    while (curr != NULL && ab != curr) {
-        prev = curr;
-        curr = curr->next;
+    retiree_slot_t *slot = &g_retiree_slots[ab->slot];
+    size_t word;
+
+    do {
+        word = slot->word;
+        assert((addr_buffer_t*)(word & SLOT_PTR_MASK) == ab);
+        assert(word & SLOT_REF_MASK);
+        if (word & SLOT_RETIRED) return; // Somebody beat us to it.
+    } while (!BCAS(&slot->word, word, word | SLOT_RETIRED));
+
+    __sync_fetch_and_sub(&g_n_retirees, 1);
+}
+
+/**
+ * Take a reference to a retiree buffer with work left in it.
+ * @return The buffer, or NULL if there is none.
+ */
+addr_buffer_t *forkscan_buffer_get_retiree_buffer ()
+{
+    int i, hwm;
+
+    if (0 == g_n_retirees) return NULL;
+    if (g_waiting_retirees) {
+        pthread_mutex_lock(&g_retiree_mutex);
+        publish_waiting();
+        pthread_mutex_unlock(&g_retiree_mutex);
     }
-    if (curr == ab) {
-        // ab was still in the list of retiree buffers.  Splice it out.
-        if (prev) prev->next = curr->next;
-        else g_first_retiree_buffer = curr->next;
 
-        if (g_first_retiree_buffer == NULL) {
-            g_last_retiree_buffer = NULL;
+    hwm = g_retiree_slot_hwm;
+    for (i = 0; i < hwm; ++i) {
+        retiree_slot_t *slot = &g_retiree_slots[i];
+        size_t word = slot->word;
+        while (0 != word && !(word & SLOT_RETIRED)) {
+            assert((word & SLOT_REF_MASK) < SLOT_REF_MASK);
+            if (BCAS(&slot->word, word, word + 1)) {
+                return (addr_buffer_t*)(word & SLOT_PTR_MASK);
+            }
+            word = slot->word;
         }
     }
-    pthread_mutex_unlock(&g_retiree_mutex);
+    return NULL;
 }
 
-addr_buffer_t *forkscan_buffer_get_retiree_buffer ()
+int forkscan_buffer_has_retirees ()
 {
-    addr_buffer_t *ret = NULL;
-    if (NULL == g_first_retiree_buffer) return NULL;
-    pthread_mutex_lock(&g_retiree_mutex);
-    if (NULL != g_first_retiree_buffer) {
-        ret = g_first_retiree_buffer;
-        ++ret->ref_count;
+    return 0 != g_n_retirees;
+}
+
+int forkscan_buffer_claim_range (addr_buffer_t *ab, int hint, int range,
+                                 int *begin, int *end)
+{
+    int i;
+
+    for (i = 0; i < ab->n_shards; ++i) {
+        retiree_shard_t *shard =
+            &ab->shards[(unsigned)(hint + i) % ab->n_shards];
+        if (shard->next >= shard->end) continue;
+        int b = __sync_fetch_and_add(&shard->next, range);
+        if (b >= shard->end) continue;
+        *begin = b;
+        *end = MIN_OF(shard->end, b + range);
+        return 1;
     }
-    pthread_mutex_unlock(&g_retiree_mutex);
-    return ret;
+    return 0;
 }
 
+/**
+ * Give up a reference taken with forkscan_buffer_get_retiree_buffer().
+ * The last reference to a popped buffer releases it.
+ */
 void forkscan_buffer_unref_buffer (addr_buffer_t *ab)
 {
-    pthread_mutex_lock(&g_retiree_mutex);
-    if (0 == --ab->ref_count) {
-        if (ab->free_idx >= ab->n_addrs) {
-            forkscan_release_buffer(ab);
+    retiree_slot_t *slot = &g_retiree_slots[ab->slot];
+    size_t word, new_word;
+
+    do {
+        word = slot->word;
+        assert((addr_buffer_t*)(word & SLOT_PTR_MASK) == ab);
+        assert(word & SLOT_REF_MASK);
+        new_word = word - 1;
+        if (new_word == ((size_t)ab | SLOT_RETIRED)) new_word = 0;
+    } while (!BCAS(&slot->word, word, new_word));
+
+    if (0 == new_word) {
+        forkscan_release_buffer(ab);
+        if (g_waiting_retirees) {
+            pthread_mutex_lock(&g_retiree_mutex);
+            publish_waiting();
+            pthread_mutex_unlock(&g_retiree_mutex);
         }
     }
-    pthread_mutex_unlock(&g_retiree_mutex);
+}
+
+/**
+ * Copy the not-yet-free'd addresses in ab into ret.
+ * @return Zero if ret is full.
+ */
+static int add_dead_references (addr_buffer_t *ret, addr_buffer_t *ab)
+{
+    int i;
+    for (i = 0; i < ab->n_addrs; ++i) {
+        size_t addr = ab->addrs[i];
+        if (0 != (addr & 0x3)) continue;
+        ret->sizes[ret->n_addrs] = ab->sizes[i];
+        ret->addrs[ret->n_addrs++] = addr;
+
+        // Special case: Maybe more dead ptrs than we have capacity.
+        // This should be exceedingly rare.  But if it happens, we'll
+        // be okay -- just count some false positive references.
+        if (ret->n_addrs >= ret->capacity) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Make the buffer that forkscan_buffer_get_dead_references() fills, if it
+ * hasn't been made yet.  This allocates, so it must be called before the
+ * fork: the child can't take locks that a stopped thread might hold.
+ */
+void forkscan_buffer_make_dead_references ()
+{
+    if (NULL != g_dead_references) return;
+
+    assert(g_default_capacity > 0);
+    size_t sz = g_default_capacity
+        * (sizeof(size_t) + sizeof(unsigned int)) + PAGESIZE;
+    // mmap_shared to avoid the cost of COW.  This also needs to change
+    // if iterations are ever done in parallel.
+    char *raw_mem = forkscan_alloc_mmap_shared(sz, "deadrefs");
+    addr_buffer_t *ret = (addr_buffer_t*)raw_mem;
+    ret->addrs = (size_t*)&raw_mem[PAGESIZE];
+    ret->sizes = (unsigned int*)
+        &raw_mem[PAGESIZE + g_default_capacity * sizeof(size_t)];
+    ret->types = NULL;
+    ret->n_addrs = 0;
+    ret->capacity = g_default_capacity;
+    ret->is_aggregate = 0;
+    g_dead_references = ret;
 }
 
 /**
  * Return a set of dead references (that might otherwise lead to false
  * positives).  This takes no lock and should not be called when other
- * threads could be acting on the list.
+ * threads could be acting on the list.  The buffer must already have been
+ * made with forkscan_buffer_make_dead_references().
  */
 addr_buffer_t *forkscan_buffer_get_dead_references ()
 {
-    // We can make *ret a static variable since it will only ever be used
-    // in sequential reclamation iterations.
-    static addr_buffer_t *ret = NULL;
-    if (NULL == ret) {
-        assert(g_default_capacity > 0);
-        size_t sz = g_default_capacity * sizeof(size_t) + PAGESIZE;
-        // mmap_shared to avoid the cost of COW.  This also needs to change
-        // if iterations are ever done in parallel.
-        char *raw_mem = forkscan_alloc_mmap_shared(sz, "deadrefs");
-        ret = (addr_buffer_t*)raw_mem;
-        ret->addrs = (size_t*)&raw_mem[PAGESIZE];
-        ret->n_addrs = 0;
-        ret->capacity = g_default_capacity;
-        ret->is_aggregate = 0;
-        ret->ref_count = 0;
-    }
+    addr_buffer_t *ret = g_dead_references;
 
+    assert(ret);
     ret->n_addrs = 0;
 
-    // CAUTION: This loop assumes nobody is messing with retirees at just
-    // this moment!  If that assumption changes, take out the mutex.
+    // CAUTION: These loops assume nobody is messing with retirees at just
+    // this moment!  If that assumption changes, take references.
     addr_buffer_t *ab;
-    for (ab = g_first_retiree_buffer; ab != NULL; ab = ab->next) {
-        int i;
-        for (i = 0; i < ab->n_addrs; ++i) {
-            size_t addr = ab->addrs[i];
-            if (0 != (addr & 0x3)) continue;
-            ret->addrs[ret->n_addrs++] = addr;
-
-            // Special case: Maybe more dead ptrs than we have capacity.
-            // This should be exceedingly rare.  But if it happens, we'll
-            // be okay -- just count some false positive references.
-            if (ret->n_addrs >= ret->capacity) return ret;
-        }
+    int slot;
+    for (slot = 0; slot < g_retiree_slot_hwm; ++slot) {
+        ab = (addr_buffer_t*)(g_retiree_slots[slot].word & SLOT_PTR_MASK);
+        if (ab && !add_dead_references(ret, ab)) return ret;
+    }
+    for (ab = g_waiting_retirees; ab != NULL; ab = ab->next) {
+        if (!add_dead_references(ret, ab)) return ret;
     }
 
     return ret;
 }
 
+DEFINE_POOL_ALLOC(spill, sizeof(spill_chunk_t), 16, forkscan_alloc_mmap)
+
+/**
+ * Add addr to a thread's spill chunk, starting a new chunk if needed, and
+ * hand the chunk off to the GC thread once it is full.
+ * @return 1 on success, zero if the spill limit has been reached.
+ */
+int forkscan_buffer_spill (spill_chunk_t **chunk, size_t addr)
+{
+    spill_chunk_t *sc = *chunk;
+
+    if (NULL == sc) {
+        // Reserve room for a whole chunk against the limit.
+        if (__sync_add_and_fetch(&g_spilled, SPILL_CHUNK_SZ)
+            > g_forkscan_spill_limit) {
+            __sync_fetch_and_sub(&g_spilled, SPILL_CHUNK_SZ);
+            return 0;
+        }
+        sc = (spill_chunk_t*)pool_alloc_spill();
+        sc->n_addrs = 0;
+        *chunk = sc;
+    }
+
+    sc->addrs[sc->n_addrs++] = addr;
+    if (sc->n_addrs == SPILL_CHUNK_SZ) forkscan_buffer_spill_flush(chunk);
+    return 1;
+}
+
+/**
+ * Hand off a thread's partially-filled spill chunk, if it has one.
+ */
+void forkscan_buffer_spill_flush (spill_chunk_t **chunk)
+{
+    spill_chunk_t *sc = *chunk;
+    if (NULL == sc) return;
+
+    *chunk = NULL;
+    do {
+        sc->next = g_spill_list;
+    } while (!BCAS(&g_spill_list, sc->next, sc));
+}
+
+/**
+ * Take every chunk that has been handed off.  The total number of
+ * pointers is returned in *n_addrs.
+ */
+spill_chunk_t *forkscan_buffer_take_spill (int *n_addrs)
+{
+    // Chunks are only ever taken all at once, so there's no ABA to worry
+    // about on the push side.
+    spill_chunk_t *list = __sync_lock_test_and_set(&g_spill_list, NULL);
+    spill_chunk_t *sc;
+
+    *n_addrs = 0;
+    for (sc = list; sc != NULL; sc = sc->next) *n_addrs += sc->n_addrs;
+    return list;
+}
+
+/**
+ * Release chunks taken with forkscan_buffer_take_spill().
+ */
+void forkscan_buffer_release_spill (spill_chunk_t *list)
+{
+    while (list) {
+        spill_chunk_t *next = list->next;
+        pool_free_spill(list);
+        __sync_fetch_and_sub(&g_spilled, SPILL_CHUNK_SZ);
+        list = next;
+    }
+}
+
 DEFINE_POOL_ALLOC(stack, STACKSIZE, NSTACKS, forkscan_alloc_mmap)
 
 void *forkscan_buffer_makestack (size_t *stacksize)
@@ -34,9 +34,27 @@ enum sibling_mode_t { SIBLING_MODE_MARKING,
 
 typedef struct addr_buffer_t addr_buffer_t;
 
+typedef struct spill_chunk_t spill_chunk_t;
+
+typedef struct retiree_shard_t retiree_shard_t;
+
+// Most ways a retiree buffer is split up for free'ing threads to claim.
+#define RETIREE_SHARDS 16
+
+/** A stretch of a retiree buffer.  Free'ing threads claim ranges from the
+ *  shard for their CPU, and from other shards once theirs runs dry.
+ */
+struct retiree_shard_t {
+    volatile int next; // Start of the next range to hand out.
+    int end;
+} __attribute__((aligned(64)));
+
 struct addr_buffer_t {
     addr_buffer_t *next;
     size_t *addrs;
+    unsigned int *sizes; // Object sizes, parallel to addrs.  Not in
+                         // reclaimer buffers, whose addrs are sized ptrs.
+    unsigned short *types; // Type IDs, parallel to addrs.  Aggregates only.
     size_t *minimap;
     int is_aggregate; // Has minimap space.
     int n_addrs;
@@ -49,11 +67,25 @@ struct addr_buffer_t {
     volatile int round; // Trust we won't need more than 2 billion rounds.
     volatile int root_counter;
     volatile int roots_completed;
+    volatile int n_unmarked; // Candidates not (yet) found to be reachable.
+    volatile int shared_scanned; // Child is done with MAP_SHARED memory.
 
     // After marking has been done, these fields are used by threads that
     // want to free the unreferenced nodes.
-    volatile int ref_count;
-    volatile int free_idx;
+    int slot; // Where it is published for free'ing, or -1.
+    int n_shards;
+    retiree_shard_t shards[RETIREE_SHARDS];
+};
+
+// A chunk, header included, fills two pages.
+#define SPILL_CHUNK_SZ 1022
+
+/** Pointers retired while their thread's queue was full.
+ */
+struct spill_chunk_t {
+    spill_chunk_t *next;
+    size_t n_addrs;
+    size_t addrs[SPILL_CHUNK_SZ];
 };
 
 addr_buffer_t *forkscan_make_reclaimer_buffer ();
@@ -68,10 +100,50 @@ void forkscan_buffer_pop_retiree_buffer (addr_buffer_t *ab);
 
 addr_buffer_t *forkscan_buffer_get_retiree_buffer ();
 
+/**
+ * Claim up to range addresses of a retiree buffer to free, starting with
+ * shard "hint" (the caller's CPU is a good choice).
+ * @return 1 with the range in [*begin, *end), or zero if every address
+ * has been claimed.
+ */
+int forkscan_buffer_claim_range (addr_buffer_t *ab, int hint, int range,
+                                 int *begin, int *end);
+
+int forkscan_buffer_has_retirees ();
+
 void forkscan_buffer_unref_buffer (addr_buffer_t *ab);
 
+/**
+ * Make the buffer that forkscan_buffer_get_dead_references() fills, if it
+ * hasn't been made yet.  Call this before forking the child.
+ */
+void forkscan_buffer_make_dead_references ();
+
 addr_buffer_t *forkscan_buffer_get_dead_references ();
 
+/**
+ * Add addr to a thread's spill chunk, starting a new chunk if needed, and
+ * hand the chunk off to the GC thread once it is full.
+ * @return 1 on success, zero if the spill limit has been reached.
+ */
+int forkscan_buffer_spill (spill_chunk_t **chunk, size_t addr);
+
+/**
+ * Hand off a thread's partially-filled spill chunk, if it has one.
+ */
+void forkscan_buffer_spill_flush (spill_chunk_t **chunk);
+
+/**
+ * Take every chunk that has been handed off.  The total number of
+ * pointers is returned in *n_addrs.
+ */
+spill_chunk_t *forkscan_buffer_take_spill (int *n_addrs);
+
+/**
+ * Release chunks taken with forkscan_buffer_take_spill().
+ */
+void forkscan_buffer_release_spill (spill_chunk_t *list);
+
 void *forkscan_buffer_makestack (size_t *stacksize);
 
 void forkscan_buffer_freestack (void *p);
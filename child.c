@@ -26,12 +26,16 @@ THE SOFTWARE.
 #include "child.h"
 #include "env.h"
 #include <errno.h>
+#include "large.h"
+#include <linux/magic.h>
 #include <malloc.h>
 #include "proc.h"
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/vfs.h>
+#include "types.h"
 #include <unistd.h>
 #include "util.h"
 
@@ -40,20 +44,42 @@ THE SOFTWARE.
 /****************************************************************************/
 
 #define MAX_MARK_AND_SWEEP_RANGES 0x10000
-#define LOOKASIDE_SZ 0x4000
+#define MAX_SHARED_RANGES 0x1000
 #define BINARY_THRESHOLD 32
-#define MAX_RANGE_SIZE (8 * 1024 * 1024)
-#define MEMORY_THRESHOLD (1024 * 1024 * 16)
+#define RANGE_HISTORY_BITS 12
+#define RANGE_HISTORY_SZ ((size_t)1 << RANGE_HISTORY_BITS)
+#define RANGE_HISTORY_PROBES 8
+#define RANGE_SCORE_MAX ((size_t)1 << 46)
+#define RANGE_IDX_BITS 16 // log2(MAX_MARK_AND_SWEEP_RANGES)
+#define RANGE_IDX_MASK (((size_t)1 << RANGE_IDX_BITS) - 1)
+#define RANGE_ORDER_HEAP ((size_t)1 << 63)
 
 typedef struct trace_stats_t trace_stats_t;
+typedef struct range_history_t range_history_t;
 
 struct trace_stats_t
 {
     size_t min, max;
+    size_t large_min, large_max; // [large_min, large_max) for large objects.
+};
+
+/** How productive a range of memory has been at finding roots in earlier
+ *  iterations.  Lives in memory shared with the parent so the scores
+ *  survive from one child to the next.
+ */
+struct range_history_t
+{
+    size_t low;
+    size_t score;
 };
 
 static mem_range_t g_ranges[MAX_MARK_AND_SWEEP_RANGES];
+static size_t g_range_order[MAX_MARK_AND_SWEEP_RANGES];
 static int g_n_ranges;
+static int g_n_stack_ranges;
+static mem_range_t g_shared_ranges[MAX_SHARED_RANGES];
+static int g_n_shared_ranges;
+static range_history_t *g_range_history;
 static size_t g_bytes_to_scan;
 static size_t g_lookaside_list[LOOKASIDE_SZ];
 static int g_lookaside_count = 0;
@@ -69,6 +95,116 @@ static int is_ref (addr_buffer_t *ab, int loc, size_t cmp)
     return PTR_MASK(ab->addrs[loc]) == cmp;
 }
 
+/**
+ * Mark the address at loc as reachable.  Return 1 if this call did the
+ * marking, zero if it was already marked.  Siblings race on this, so it
+ * must be atomic to keep n_unmarked honest.
+ */
+static int mark_addr (addr_buffer_t *ab, int loc)
+{
+    size_t old = __sync_fetch_and_or(&ab->addrs[loc], 0x1);
+    if (old & 0x1) return 0;
+    __sync_fetch_and_sub(&ab->n_unmarked, 1);
+    return 1;
+}
+
+/**
+ * Set up the bounds on values that could possibly refer to a candidate.
+ * Either set may be empty.
+ */
+static void trace_stats_init (trace_stats_t *ts, addr_buffer_t *ab)
+{
+    large_obj_t *large;
+    int n_large;
+
+    if (ab->n_addrs > 0) {
+        ts->min = PTR_MASK(ab->addrs[0]);
+        ts->max = PTR_MASK(ab->addrs[ab->n_addrs - 1]);
+    } else {
+        ts->min = (size_t)-1;
+        ts->max = 0;
+    }
+
+    large = forkscan_large_candidates(&n_large);
+    if (n_large > 0) {
+        ts->large_min = large[0].low;
+        ts->large_max = large[n_large - 1].high;
+    } else {
+        ts->large_min = (size_t)-1;
+        ts->large_max = 0;
+    }
+}
+
+/****************************************************************************/
+/*                          Range ordering history.                         */
+/****************************************************************************/
+
+/**
+ * Return the slot for the range starting at low: its own, if it has one,
+ * or else an empty slot or the lowest-scoring one among its probes.
+ */
+static range_history_t *range_history_find (size_t low)
+{
+    size_t h = (low / PAGESIZE) * 0x9E3779B97F4A7C15ULL;
+    range_history_t *victim = NULL;
+    int i;
+
+    h >>= 64 - RANGE_HISTORY_BITS;
+    for (i = 0; i < RANGE_HISTORY_PROBES; ++i) {
+        range_history_t *rh =
+            &g_range_history[(h + i) & (RANGE_HISTORY_SZ - 1)];
+        if (rh->low == low) return rh;
+        if (rh->low == 0) return rh;
+        if (NULL == victim || rh->score < victim->score) victim = rh;
+    }
+    return victim;
+}
+
+static size_t range_history_score (size_t low)
+{
+    range_history_t *rh = range_history_find(low);
+    return rh->low == low ? rh->score : 0;
+}
+
+/**
+ * Fold the number of roots found in a range into its score.  Old results
+ * decay by half each time the range is scanned.  A range without a slot
+ * takes over the weakest one it could have had, if it beats it; if not,
+ * that one still decays, so ranges that are no longer scanned (unmapped,
+ * or exited threads' stacks) make way in time.
+ */
+static void range_history_record (size_t low, size_t roots)
+{
+    range_history_t *rh = range_history_find(low);
+    size_t old = rh->low;
+    if (old != low) {
+        if (roots <= rh->score) {
+            rh->score /= 2;
+            return;
+        }
+        if (!BCAS(&rh->low, old, low)) return;
+        rh->score = 0;
+    }
+    rh->score = MIN_OF(rh->score / 2 + roots, RANGE_SCORE_MAX);
+}
+
+/**
+ * Order g_ranges so that the ones most likely to produce roots are scanned
+ * first: stacks, then the hottest heap ranges.  Since the scan stops when
+ * every candidate has been marked, this lets it stop sooner.
+ */
+static void order_ranges ()
+{
+    int i;
+    for (i = 0; i < g_n_ranges; ++i) {
+        size_t score = range_history_score(g_ranges[i].low);
+        size_t key = (RANGE_SCORE_MAX - score) << RANGE_IDX_BITS;
+        if (i >= g_n_stack_ranges) key |= RANGE_ORDER_HEAP;
+        g_range_order[i] = key | (size_t)i;
+    }
+    forkscan_util_sort(g_range_order, g_n_ranges);
+}
+
 /****************************************************************************/
 /*                            Search utilities.                             */
 /****************************************************************************/
@@ -142,40 +278,115 @@ static int addr_find_hint (size_t val, addr_buffer_t *ab, int hint)
     return addr_find(val, ab);
 }
 
-static inline void recursive_mark (size_t addr,
+static void mark_block (size_t *ptr,
+                        size_t n_vals,
+                        addr_buffer_t *ab,
+                        trace_stats_t *ts);
+
+static void mark_val (size_t val, addr_buffer_t *ab, trace_stats_t *ts);
+
+static inline void recursive_mark (int loc,
                                    addr_buffer_t *ab,
                                    trace_stats_t *ts)
 {
-    size_t *ptr = (size_t*)PTR_MASK(addr);
-    size_t n_vals = MALLOC_USABLE_SIZE(ptr) / sizeof(size_t);
-    size_t i;
+    size_t *ptr = (size_t*)PTR_MASK(ab->addrs[loc]);
+    size_t n_vals = ab->sizes[loc] / sizeof(size_t);
+
+    // Pointer-free blocks are leaves.
+    if (forkscan_nopointers_owns((size_t)ptr)) return;
+
+    if (ab->types[loc]) {
+        // Typed: follow only the words named in the pointer map.  An empty
+        // map is a leaf, with nothing to follow.
+        unsigned long long map = forkscan_types_get(ab->types[loc])->ptr_map;
+        while (map) {
+            size_t i = __builtin_ctzll(map);
+            if (i >= n_vals) break;
+            mark_val(ptr[i], ab, ts);
+            map &= map - 1;
+        }
+        if (n_vals <= TYPE_MAP_WORDS) return;
+        // The map doesn't reach this far.  Be conservative.
+        ptr += TYPE_MAP_WORDS;
+        n_vals -= TYPE_MAP_WORDS;
+    }
+    mark_block(ptr, n_vals, ab, ts);
+}
 
-    for (i = 0; i < n_vals; ++i) {
-        size_t val = PTR_MASK(ptr[i]);
-        if (val < ts->min || val > ts->max) continue;
-        int loc = addr_find(val, ab);
-        if (is_ref(ab, loc, val)) {
-            // Found a hit inside our pool.
-            size_t target = ab->addrs[loc];
-            if (target & 0x1) {
-                // Already recursively searched.
-                continue;
-            }
+/**
+ * If val points anywhere into a large-object candidate, mark it and trace
+ * through it.  Return 1 if this call did the marking, zero otherwise.
+ */
+static int mark_large (size_t val, addr_buffer_t *ab, trace_stats_t *ts)
+{
+    large_obj_t *lo = forkscan_large_find(val);
+    if (NULL == lo || lo->marked || !BCAS(&lo->marked, 0, 1)) return 0;
+    __sync_fetch_and_sub(&ab->n_unmarked, 1);
+    mark_block((size_t*)lo->low, (lo->high - lo->low) / sizeof(size_t),
+               ab, ts);
+    return 1;
+}
 
-            // Technically a race condition, but anybody racing with us is
-            // trying to write the same value:
-            ab->addrs[loc] = target | 0x1;
-            recursive_mark(PTR_MASK(addr), ab, ts);
+/**
+ * If val is a candidate in the slab arena, mark it through the side bitmap
+ * and trace through it.  Return 1 if this call did the marking, zero
+ * otherwise.
+ */
+static int mark_slab (size_t val, addr_buffer_t *ab, trace_stats_t *ts)
+{
+    if (!forkscan_slab_mark(val)) return 0;
+    __sync_fetch_and_sub(&ab->n_unmarked, 1);
+    mark_block((size_t*)val, forkscan_slab_usable_size(val) / sizeof(size_t),
+               ab, ts);
+    return 1;
+}
+
+/**
+ * Mark whatever the word "val", found in a reachable node, refers to.
+ */
+static void mark_val (size_t val, addr_buffer_t *ab, trace_stats_t *ts)
+{
+    val = PTR_MASK(val);
+    if (val >= ts->large_min && val < ts->large_max) {
+        mark_large(val, ab, ts);
+    }
+    if (val < ts->min || val > ts->max) return;
+    if (forkscan_slab_owns(val)) {
+        mark_slab(val, ab, ts);
+        return;
+    }
+    int loc = addr_find(val, ab);
+    if (is_ref(ab, loc, val)) {
+        // Found a hit inside our pool.
+        if (!mark_addr(ab, loc)) {
+            // Already recursively searched.
+            return;
         }
+        recursive_mark(loc, ab, ts);
     }
 }
 
-static void lookup_lookaside_list (addr_buffer_t *ab,
-                                   trace_stats_t *ts)
+static void mark_block (size_t *ptr,
+                        size_t n_vals,
+                        addr_buffer_t *ab,
+                        trace_stats_t *ts)
+{
+    size_t i;
+
+    for (i = 0; i < n_vals; ++i) mark_val(ptr[i], ab, ts);
+}
+
+/**
+ * Look up the addresses saved on the lookaside list and mark any that are
+ * in the pool.  Return the number of roots that were newly marked.
+ */
+static int lookup_lookaside_list (addr_buffer_t *ab,
+                                  trace_stats_t *ts)
 {
     int i;
     size_t cmp = 0;
     int savings;
+    int roots = 0;
 
 #ifdef TIMING
     size_t start_sort, end_sort;
@@ -201,12 +412,9 @@ static void lookup_lookaside_list (addr_buffer_t *ab,
         cached_loc = loc;
         if (is_ref(ab, loc, cmp)) {
             // It's a pointer somewhere into the allocated region of memory.
-            size_t addr = ab->addrs[loc];
-            if (!(addr & 0x1)) {
-                // No need to be atomic.  Any processes racing with us are
-                // trying to write the same value.
-                ab->addrs[loc] = addr | 0x1;
-                recursive_mark(addr, ab, ts);
+            if (!(ab->addrs[loc] & 0x1) && mark_addr(ab, loc)) {
+                ++roots;
+                recursive_mark(loc, ab, ts);
             }
         }
 #ifndef NDEBUG
@@ -225,28 +433,30 @@ static void lookup_lookaside_list (addr_buffer_t *ab,
 #endif
 
     g_lookaside_count = 0;
+
+    return roots;
 }
 
 /**
  * Search through the given chunk of memory looking for references into the
  * memory we're tracking from outside the memory we're tracking.  These roots
  * will later be used as a basis for determining reachability of the rest of
- * the nodes.
+ * the nodes.  The search gives up early if every node has been marked.
+ *
+ * @return The number of roots found in the chunk.
  */
-static void find_roots (size_t low,
+static int find_roots (size_t low,
                         size_t high,
                         addr_buffer_t *ab,
                         addr_buffer_t *deadrefs)
 {
-    int pool_idx, dead_idx = 0;
+    int pool_idx = 0, dead_idx = 0;
     size_t pool_addr, dead_addr;
     size_t guarded_addr;
     trace_stats_t ts;
+    int roots = 0;
 
-    ts.min = PTR_MASK(ab->addrs[0]);
-    ts.max = PTR_MASK(ab->addrs[ab->n_addrs - 1]);
-
-    assert(ts.min <= ts.max);
+    trace_stats_init(&ts, ab);
 
     void update_addr_loc (int *idx, size_t *addr, addr_buffer_t *buf)
     {
@@ -262,20 +472,22 @@ static void find_roots (size_t low,
     // to one of our addresses, but we avoid searching memory we're tracking
     // because that will be done during mark.  The "pool_addr" indicates the
     // next location in memory we want to _avoid_ scanning.
-    pool_idx = addr_find(low, ab);
-    pool_addr = PTR_MASK(ab->addrs[pool_idx]);
-    if (pool_addr <= low) {
-        size_t sz = MALLOC_USABLE_SIZE((void*)pool_addr);
-        if (pool_addr + sz > low) low = pool_addr + sz;
-        update_addr_loc(&pool_idx, &pool_addr, ab);
-    }
+    if (ab->n_addrs > 0) {
+        pool_idx = addr_find(low, ab);
+        pool_addr = PTR_MASK(ab->addrs[pool_idx]);
+        if (pool_addr <= low) {
+            size_t sz = ab->sizes[pool_idx];
+            if (pool_addr + sz > low) low = pool_addr + sz;
+            update_addr_loc(&pool_idx, &pool_addr, ab);
+        }
+    } else pool_addr = (size_t)-1;
 
     if (deadrefs->n_addrs > 0) {
         dead_idx = binary_search(low, deadrefs->addrs, 0, deadrefs->n_addrs);
         dead_addr = deadrefs->addrs[dead_idx];
         assert(0 == (dead_addr & 0x3));
         if (dead_addr <= low) {
-            size_t sz = MALLOC_USABLE_SIZE((void*)dead_addr);
+            size_t sz = deadrefs->sizes[dead_idx];
             if (dead_addr + sz > low) low = dead_addr + sz;
             update_addr_loc(&dead_idx, &dead_addr, deadrefs);
             assert(low <= pool_addr);
@@ -293,24 +505,40 @@ static void find_roots (size_t low,
             // PTR_MASK catches pointers that have been hidden through
             // overloading the two low-order bits.
 
+            if (cmp >= ts.large_min && cmp < ts.large_max) {
+                // Few enough large objects that there's no need to wait.
+                roots += mark_large(cmp, ab, &ts);
+            }
+
             if (cmp < ts.min || cmp > ts.max) continue; // Out-of-range.
 
+            if (forkscan_slab_owns(cmp)) {
+                // Slab objects are found in O(1); no need to wait.
+                roots += mark_slab(cmp, ab, &ts);
+                continue;
+            }
+
             // Put the address aside for future lookup.  By aggregating, we
             // can reduce the number of cache misses.
             g_lookaside_list[g_lookaside_count++] = cmp;
-            if (g_lookaside_count < LOOKASIDE_SZ) continue;
+            if (g_lookaside_count < g_forkscan_lookaside) continue;
 
             // The lookaside list is full.
-            lookup_lookaside_list(ab, &ts);
+            roots += lookup_lookaside_list(ab, &ts);
+            if (0 == ab->n_unmarked) {
+                // Nothing left to find.  No more bytes can change the result.
+                return roots;
+            }
         }
 
         assert(low == next_stopping_point);
         if (next_stopping_point == guarded_addr) {
-            low += MALLOC_USABLE_SIZE((void*)guarded_addr);
             if (guarded_addr == pool_addr) {
+                low += ab->sizes[pool_idx];
                 update_addr_loc(&pool_idx, &pool_addr, ab);
             } else {
                 assert(deadrefs);
+                low += deadrefs->sizes[dead_idx];
                 update_addr_loc(&dead_idx, &dead_addr, deadrefs);
             }
             guarded_addr = MIN_OF(pool_addr, dead_addr);
@@ -318,6 +546,13 @@ static void find_roots (size_t low,
             assert(pool_addr != dead_addr || pool_addr == (size_t)-1);
         }
     }
+
+    // Flush the lookaside list so the roots are credited to this range.
+    if (g_lookaside_count > 0) {
+        roots += lookup_lookaside_list(ab, &ts);
+    }
+
+    return roots;
 }
 
 /**
@@ -342,6 +577,74 @@ static int is_lib (const char *library, const char *path)
     }
 }
 
+/**
+ * Determine whether a MAP_SHARED range at "path" could be somebody's heap:
+ * shared anonymous memory, a memfd, SysV shm, or hugetlbfs.  Shared
+ * mappings of regular files are not.
+ *
+ * @return 1 if it should be scanned, zero otherwise.
+ */
+static int is_shared_heap (const char *path)
+{
+    struct statfs fs;
+
+    if ('\0' == path[0]) return 1;
+    if (0 == strcmp(path, "/dev/zero")) return 1; // MAP_SHARED|MAP_ANONYMOUS
+    if (0 == strcmp(path, "/anon_hugepage")) return 1; // ... |MAP_HUGETLB
+    if (0 == strncmp(path, "/memfd:", 7)) return 1;
+    if (0 == strncmp(path, "/SYSV", 5)) return 1;
+    return 0 == statfs(path, &fs) && HUGETLBFS_MAGIC == fs.f_type;
+}
+
+/**
+ * Add a range of memory to g_ranges, breaking it into manageable pieces.
+ * Large-object candidates are cut out: like the rest of the pool, they are
+ * only traced if something else refers to them.
+ */
+static void add_heap_range (mem_range_t range)
+{
+    large_obj_t *lo = forkscan_large_find(range.low);
+    large_obj_t *large;
+    size_t range_size = g_forkscan_range_size;
+    int n_large;
+
+    large = forkscan_large_candidates(&n_large);
+    if (NULL == lo) {
+        // Find the first candidate beyond range.low, if any.
+        int min = 0, max = n_large;
+        while (min < max) {
+            int mid = (min + max) / 2;
+            if (large[mid].low <= range.low) min = mid + 1;
+            else max = mid;
+        }
+        lo = &large[min];
+    }
+
+    while (range.low < range.high) {
+        mem_range_t next = range;
+        if (lo < &large[n_large] && lo->low < range.high) {
+            next.high = MAX_OF(lo->low, range.low);
+            range.low = MIN_OF(lo->high, range.high);
+            ++lo;
+        } else {
+            range.low = range.high;
+        }
+        if (next.low >= next.high) continue;
+
+        g_bytes_to_scan += next.high - next.low;
+        while (next.low + range_size < next.high) {
+            g_ranges[g_n_ranges] = next;
+            g_ranges[g_n_ranges].high = next.low + range_size;
+            next.low += range_size;
+            ++g_n_ranges;
+        }
+        g_ranges[g_n_ranges++] = next;
+        if (g_n_ranges >= MAX_MARK_AND_SWEEP_RANGES) {
+            forkscan_fatal("Too many memory ranges.\n");
+        }
+    }
+}
+
 static int collect_ranges (void *p,
                            size_t low,
                            size_t high,
@@ -382,9 +685,13 @@ static int collect_ranges (void *p,
         // Part of the Forkscan module memory.  It's clean.
         return 1;
     }
+    int shared = 0;
     if (bits[3] == 's') {
-        // Shared writable memory.  This is probably the commq.
-        return 1;
+        // Shared writable memory.  Forkscan's own shared buffers get weeded
+        // out below.  Shared memory isn't snapshotted by fork(), so it is
+        // only scanned if the user asked for it.
+        if (!g_forkscan_scan_shared || !is_shared_heap(path)) return 1;
+        shared = 1;
     }
     if (0 == memcmp(path, "[stack:", 7)) {
         // Our stack.  Don't check that.  Note: This is not one of the other
@@ -404,19 +711,16 @@ static int collect_ranges (void *p,
     mem_range_t big_range = { low, high };
     while (big_range.low != big_range.high) {
         mem_range_t next = forkscan_alloc_next_subrange(&big_range);
-        if (next.low != next.high) {
-            // This is a region of memory we want to scan.
+        if (next.low != next.high && shared) {
+            // Scanned up front, while the application is stopped.
             g_bytes_to_scan += next.high - next.low;
-            while (next.low + MAX_RANGE_SIZE < next.high) {
-                g_ranges[g_n_ranges] = next;
-                g_ranges[g_n_ranges].high = next.low + MAX_RANGE_SIZE;
-                next.low += MAX_RANGE_SIZE;
-                ++g_n_ranges;
-            }
-            g_ranges[g_n_ranges++] = next;
-            if (g_n_ranges >= MAX_MARK_AND_SWEEP_RANGES) {
-                forkscan_fatal("Too many memory ranges.\n");
+            g_shared_ranges[g_n_shared_ranges++] = next;
+            if (g_n_shared_ranges >= MAX_SHARED_RANGES) {
+                forkscan_fatal("Too many shared memory ranges.\n");
             }
+        } else if (next.low != next.high) {
+            // This is a region of memory we want to scan.
+            add_heap_range(next);
         }
     }
 
@@ -439,7 +743,25 @@ static void add_stack_ranges ()
             g_ranges[g_n_ranges].low = (size_t)td->user_stack_low;
             ++g_n_ranges;
         }
+        if (td->blocking) {
+            // Registers it had when it entered its blocking region.
+            g_ranges[g_n_ranges].low = (size_t)td->blocking_regs;
+            g_ranges[g_n_ranges].high = (size_t)(td->blocking_regs + 6);
+            ++g_n_ranges;
+        }
     }
+    g_n_stack_ranges = g_n_ranges;
+}
+
+/**
+ * Return how many processes share a scan of bytes_to_scan bytes, before
+ * the number of ranges is taken into account.
+ */
+int forkscan_child_count (size_t bytes_to_scan)
+{
+    int n = MIN_OF(g_forkscan_max_children,
+                   bytes_to_scan / g_forkscan_child_threshold);
+    return MAX_OF(n, 1);
 }
 
 void forkscan_child (addr_buffer_t *ab, addr_buffer_t *deadrefs, int fd)
@@ -447,26 +769,41 @@ void forkscan_child (addr_buffer_t *ab, addr_buffer_t *deadrefs, int fd)
     assert(ab);
     assert(deadrefs);
 
-    // Scan memory for references.
+    // Scan memory for references.  Stacks go in first since they are the
+    // most likely place to find roots.
     g_bytes_to_scan = 0;
-    forkscan_proc_map_iterate(collect_ranges, NULL);
     add_stack_ranges();
+    forkscan_proc_map_iterate(collect_ranges, NULL);
+    order_ranges();
     ab->completed_children = 0;
     ab->cutoff_reached = 0;
     ab->round = 0;
 
-    int n_siblings = MIN_OF(g_forkscan_max_children,
-                            g_bytes_to_scan / MEMORY_THRESHOLD);
+    int n_siblings = forkscan_child_count(g_bytes_to_scan);
     n_siblings = MIN_OF(n_siblings, g_n_ranges);
     n_siblings = MAX_OF(n_siblings, 1);
 
     ab->sibling_mode = SIBLING_MODE_MARKING;
     ab->root_counter = 0;
     ab->roots_completed = 0;
+    int n_large;
+    forkscan_large_candidates(&n_large);
+    ab->n_unmarked = ab->n_addrs + n_large;
 
     trace_stats_t ts;
-    ts.min = PTR_MASK(ab->addrs[0]);
-    ts.max = PTR_MASK(ab->addrs[ab->n_addrs - 1]);
+    trace_stats_init(&ts, ab);
+
+    // Slab candidates are marked in a side bitmap, visible to siblings.
+    forkscan_slab_set_candidates(ab->addrs, ab->n_addrs);
+
+    // The parent keeps the application stopped until shared memory has
+    // been scanned, so get it out of the way before anything else.
+    int i;
+    for (i = 0; i < g_n_shared_ranges && ab->n_unmarked > 0; ++i) {
+        find_roots(g_shared_ranges[i].low, g_shared_ranges[i].high,
+                   ab, deadrefs);
+    }
+    ab->shared_scanned = 1;
 
     int sibling_id = 0;
     for (sibling_id = 0; sibling_id < n_siblings - 1; ++sibling_id) {
@@ -488,8 +825,15 @@ void forkscan_child (addr_buffer_t *ab, addr_buffer_t *deadrefs, int fd)
         // to be done in root finding.
         //
         // Will's judgment: This is okay.
-        find_roots(g_ranges[rid].low, g_ranges[rid].high, ab, deadrefs);
-        total_memory += g_ranges[rid].high - g_ranges[rid].low;
+        //
+        // Once everything is marked, keep claiming ranges (so the last one
+        // through can notify the parent) but don't bother scanning them.
+        mem_range_t *range = &g_ranges[g_range_order[rid] & RANGE_IDX_MASK];
+        if (ab->n_unmarked > 0) {
+            int roots = find_roots(range->low, range->high, ab, deadrefs);
+            range_history_record(range->low, roots);
+            total_memory += range->high - range->low;
+        }
         ++roots_completed;
     }
 
@@ -514,9 +858,20 @@ void forkscan_child (addr_buffer_t *ab, addr_buffer_t *deadrefs, int fd)
 
     if (total_roots == g_n_ranges) {
         // This child completed the final range.  It gets to notify the parent
-        // that scanning is complete.
+        // that scanning is complete.  Everyone else is done marking, so
+        // the slab marks can be folded into the address list.
+        forkscan_slab_collect_marks(ab->addrs, ab->n_addrs);
         if (sizeof(size_t) != write(fd, &g_bytes_to_scan, sizeof(size_t))) {
             forkscan_fatal("Failed to write to parent.\n");
         }
     }
 }
+
+__attribute__((constructor))
+static void child_init ()
+{
+    // Allocated up front, in the parent, so every child shares the history.
+    g_range_history = (range_history_t*)
+        forkscan_alloc_mmap_shared(RANGE_HISTORY_SZ * sizeof(range_history_t),
+                                   "range history");
+}
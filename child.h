@@ -28,4 +28,10 @@ THE SOFTWARE.
 
 void forkscan_child (addr_buffer_t *ab, addr_buffer_t *deadrefs, int fd);
 
+/**
+ * Return how many processes share a scan of bytes_to_scan bytes, before
+ * the number of ranges is taken into account.
+ */
+int forkscan_child_count (size_t bytes_to_scan);
+
 #endif // !defined _CHILD_H_
@@ -26,10 +26,13 @@ THE SOFTWARE.
 #include "util.h"
 
 #define DEFAULT_THROTTLING_QUEUE 16
-#define MAX_THROTTLING_QUEUE 32
+#define DEFAULT_SPILL_LIMIT (1024 * 1024)
+#define DEFAULT_MAGAZINE_SIZE 64
+#define MAX_MAGAZINE_SIZE 4096
+#define MAX_FREER_THREADS 64
+#define DEFAULT_FREE_LATENCY_NS 20000
 
 #define MAX_PTRS_PER_THREAD (1024 * 1024)
-#define MIN_PTRS_PER_THREAD 1024
 
 static const char env_ptrs_per_thread[] = "FORKSCAN_PTRS_PER_THREAD";
 
@@ -39,6 +42,47 @@ static const char env_throttling_queue[] = "FORKSCAN_THROTTLING_QUEUE";
 
 static const char env_max_children[] = "FORKSCAN_MAX_CHILDREN";
 
+static const char env_lookaside[] = "FORKSCAN_LOOKASIDE";
+static const char env_range_size_kb[] = "FORKSCAN_RANGE_SIZE_KB";
+static const char env_child_threshold_mb[] = "FORKSCAN_CHILD_THRESHOLD_MB";
+
+static const char env_huge_pages[] = "FORKSCAN_HUGE_PAGES";
+
+static const char env_scan_shared[] = "FORKSCAN_SCAN_SHARED";
+
+static const char env_slab[] = "FORKSCAN_SLAB";
+
+static const char env_spill_limit[] = "FORKSCAN_SPILL_LIMIT";
+
+static const char env_magazine_size[] = "FORKSCAN_MAGAZINE_SIZE";
+
+static const char env_freer_threads[] = "FORKSCAN_FREER_THREADS";
+
+static const char env_freer_cpus[] = "FORKSCAN_FREER_CPUS";
+
+static const char env_freer_nice[] = "FORKSCAN_FREER_NICE";
+
+static const char env_app_frees[] = "FORKSCAN_APP_FREES";
+
+static const char env_free_latency_ns[] = "FORKSCAN_FREE_LATENCY_NS";
+
+static const char env_free_range[] = "FORKSCAN_FREE_RANGE";
+
+static const char env_zero[] = "FORKSCAN_ZERO";
+
+static const char env_numa[] = "FORKSCAN_NUMA";
+static const char env_safepoints[] = "FORKSCAN_SAFEPOINTS";
+static const char env_memory_target_mb[] = "FORKSCAN_MEMORY_TARGET_MB";
+static const char env_period_ms[] = "FORKSCAN_PERIOD_MS";
+static const char env_max_latency_ms[] = "FORKSCAN_MAX_LATENCY_MS";
+static const char env_trigger_min[] = "FORKSCAN_TRIGGER_MIN";
+static const char env_pressure[] = "FORKSCAN_PRESSURE";
+static const char env_pressure_stall_ms[] = "FORKSCAN_PRESSURE_STALL_MS";
+static const char env_autotune[] = "FORKSCAN_AUTOTUNE";
+static const char env_tune_overhead[] = "FORKSCAN_TUNE_OVERHEAD";
+static const char env_config[] = "FORKSCAN_CONFIG";
+static const char env_wrap_blocking[] = "FORKSCAN_WRAP_BLOCKING";
+
 // # of ptrs a thread can "save up" before initiating a collection run.
 // The number of pointers per thread should be a power of 2 because we use
 // this number to do masking (to avoid the costly modulo operation).
@@ -48,10 +92,61 @@ int g_forkscan_ptrs_per_thread;
 int g_forkscan_report_statistics;
 
 // How many collects can queue up before user threads get throttled.
-int g_forkscan_throttling_queue;
+volatile int g_forkscan_throttling_queue;
 
 // Maximum number of children to fork to participate in a scan of memory.
-int g_forkscan_max_children;
+volatile int g_forkscan_max_children;
+
+// Lookaside list length, range size and memory per child for scans.
+volatile int g_forkscan_lookaside;
+volatile size_t g_forkscan_range_size;
+volatile size_t g_forkscan_child_threshold;
+
+// Huge page policy for Forkscan's big buffers and advice for the heap.
+int g_forkscan_huge_pages;
+
+// Whether to scan MAP_SHARED heaps (anonymous, memfd, hugetlbfs).
+int g_forkscan_scan_shared;
+
+// Whether forkscan_malloc() uses the built-in slab allocator.
+int g_forkscan_slab;
+
+// Max pointers that can be spilled from full per-thread queues.
+int g_forkscan_spill_limit;
+
+// Reclaimed blocks a thread may cache per size class for forkscan_malloc().
+int g_forkscan_magazine_size;
+
+// Background threads that free retired memory, and how they're scheduled.
+int g_forkscan_freer_threads;
+const char *g_forkscan_freer_cpus;
+int g_forkscan_freer_nice;
+
+// Whether application threads help free by default.
+int g_forkscan_app_frees;
+
+// Most time a retire may spend free'ing on others' behalf, in ns.
+int g_forkscan_free_latency_ns;
+
+// Retirees a thread claims to free at a time.
+volatile int g_forkscan_free_range;
+
+// How reclaimed blocks are cleared before they're reused.
+int g_forkscan_zero;
+
+// Whether to free blocks on, and keep thread metadata on, their own node.
+int g_forkscan_numa;
+int g_forkscan_safepoints;
+volatile size_t g_forkscan_memory_target;
+int g_forkscan_period_ms;
+int g_forkscan_max_latency_ms;
+int g_forkscan_trigger_min;
+int g_forkscan_pressure;
+int g_forkscan_pressure_stall_ms;
+int g_forkscan_autotune;
+const char *g_forkscan_config;
+int g_forkscan_tune_overhead;
+int g_forkscan_wrap_blocking;
 
 /** Parse an integer from a string.  0 if val is NULL.
  */
@@ -136,4 +231,167 @@ static void env_init ()
         }
         g_forkscan_max_children = max_children;
     }
+
+    {
+        int lookaside, range_size_kb, child_threshold_mb;
+        lookaside = get_int(getenv(env_lookaside), LOOKASIDE_SZ);
+        g_forkscan_lookaside = MAX_OF(MIN_OF(lookaside, LOOKASIDE_SZ), 1);
+        // Smaller ranges balance better across children, but there's a
+        // cap on how many a scan can have.
+        range_size_kb = get_int(getenv(env_range_size_kb),
+                                DEFAULT_RANGE_SIZE >> 10);
+        g_forkscan_range_size =
+            (size_t)MAX_OF(MIN_OF(range_size_kb, MAX_RANGE_SIZE_KB),
+                           MIN_RANGE_SIZE_KB) << 10;
+        child_threshold_mb = get_int(getenv(env_child_threshold_mb),
+                                     DEFAULT_CHILD_THRESHOLD >> 20);
+        g_forkscan_child_threshold = (size_t)MAX_OF(child_threshold_mb, 1)
+            << 20;
+    }
+
+    {
+        int huge_pages;
+        huge_pages = get_int(getenv(env_huge_pages), HUGE_PAGES_NONE);
+        if (huge_pages < HUGE_PAGES_NONE || huge_pages > HUGE_PAGES_HUGETLB) {
+            forkscan_diagnostic("warning: %s = %s\n"
+                                "  But valid values are %d-%d\n",
+                                env_huge_pages,
+                                getenv(env_huge_pages),
+                                HUGE_PAGES_NONE, HUGE_PAGES_HUGETLB);
+            huge_pages = HUGE_PAGES_NONE;
+        }
+        g_forkscan_huge_pages = huge_pages;
+    }
+
+    {
+        int scan_shared;
+        // Scanning shared memory means holding threads until the shared
+        // ranges have been scanned, since they don't get COW protection.
+        scan_shared = get_int(getenv(env_scan_shared), 0);
+        if (scan_shared != 0) g_forkscan_scan_shared = 1;
+    }
+
+    {
+        int slab;
+        // Small objects come from Forkscan's own slabs.
+        slab = get_int(getenv(env_slab), 0);
+        if (slab != 0) g_forkscan_slab = 1;
+    }
+
+    {
+        int spill_limit;
+        // Past this many spilled pointers, retiring threads wait for an
+        // iteration to finish.  Zero disables spilling.
+        spill_limit = get_int(getenv(env_spill_limit), DEFAULT_SPILL_LIMIT);
+        if (spill_limit < 0) spill_limit = 0;
+        g_forkscan_spill_limit = spill_limit;
+    }
+
+    {
+        int magazine_size;
+        // Zero disables the per-thread magazines: reclaimed blocks go
+        // straight back to the allocator.
+        magazine_size = get_int(getenv(env_magazine_size),
+                                DEFAULT_MAGAZINE_SIZE);
+        if (magazine_size < 0) magazine_size = 0;
+        if (magazine_size > MAX_MAGAZINE_SIZE) {
+            magazine_size = MAX_MAGAZINE_SIZE;
+        }
+        g_forkscan_magazine_size = magazine_size;
+    }
+
+    {
+        int freer_threads;
+        // Freer threads take the work of free'ing retired memory off of the
+        // application threads, which may then opt out of it.  The CPU list
+        // looks like "0,2-3" and is handed out to freers round-robin.
+        freer_threads = get_int(getenv(env_freer_threads), 0);
+        if (freer_threads < 0) freer_threads = 0;
+        if (freer_threads > MAX_FREER_THREADS) {
+            freer_threads = MAX_FREER_THREADS;
+        }
+        g_forkscan_freer_threads = freer_threads;
+        g_forkscan_freer_cpus = getenv(env_freer_cpus);
+        g_forkscan_freer_nice = get_int(getenv(env_freer_nice), 0);
+
+        // With nobody else to do it, application threads have to free.
+        g_forkscan_app_frees = freer_threads == 0
+            || 0 != get_int(getenv(env_app_frees), 1);
+    }
+
+    {
+        int free_latency_ns;
+        // Application threads free on a budget: enough to keep up with the
+        // backlog, but never more than this per retire.
+        free_latency_ns = get_int(getenv(env_free_latency_ns),
+                                  DEFAULT_FREE_LATENCY_NS);
+        if (free_latency_ns < 1) free_latency_ns = 1;
+        g_forkscan_free_latency_ns = free_latency_ns;
+    }
+
+    {
+        int free_range;
+        free_range = get_int(getenv(env_free_range), FREE_RANGE_SZ);
+        g_forkscan_free_range = MAX_OF(MIN_OF(free_range, FREE_RANGE_SZ), 1);
+    }
+
+    {
+        int zero;
+        zero = get_int(getenv(env_zero), ZERO_FULL);
+        if (zero < ZERO_FULL || zero > ZERO_MADVISE) {
+            forkscan_diagnostic("warning: %s = %s\n"
+                                "  But valid values are %d-%d\n",
+                                env_zero, getenv(env_zero),
+                                ZERO_FULL, ZERO_MADVISE);
+            zero = ZERO_FULL;
+        }
+        g_forkscan_zero = zero;
+    }
+
+    // Only matters on machines with more than one node.
+    g_forkscan_numa = 0 != get_int(getenv(env_numa), 1);
+
+    g_forkscan_safepoints = 0 != get_int(getenv(env_safepoints), 0);
+
+    // Off by default: the wrappers cost a little on every call.  Without
+    // signals, though, a thread parked in one would hold up every snapshot.
+    g_forkscan_wrap_blocking = 0 != get_int(getenv(env_wrap_blocking),
+                                            g_forkscan_safepoints);
+
+    g_forkscan_config = getenv(env_config);
+
+    {
+        int memory_target_mb;
+        // No target by default: iterations start when queues fill.
+        memory_target_mb = get_int(getenv(env_memory_target_mb), 0);
+        if (memory_target_mb < 0) memory_target_mb = 0;
+        g_forkscan_memory_target = (size_t)memory_target_mb << 20;
+    }
+
+    // The GC thread's own triggers, both off by default.  It starts an
+    // iteration when a retire has waited too long to be scanned, or every
+    // period, but not for fewer than trigger_min pointers.
+    g_forkscan_period_ms = MAX_OF(get_int(getenv(env_period_ms), 0), 0);
+    g_forkscan_max_latency_ms =
+        MAX_OF(get_int(getenv(env_max_latency_ms), 0), 0);
+    g_forkscan_trigger_min =
+        MAX_OF(get_int(getenv(env_trigger_min), DEFAULT_TRIGGER_MIN), 1);
+
+    {
+        int stall_ms;
+        g_forkscan_pressure = 0 != get_int(getenv(env_pressure), 0);
+        // Memory stall, per 2s window, that counts as pressure.  The
+        // kernel wants it under the window.
+        stall_ms = get_int(getenv(env_pressure_stall_ms),
+                           DEFAULT_PRESSURE_STALL_MS);
+        g_forkscan_pressure_stall_ms = MAX_OF(MIN_OF(stall_ms, 1999), 1);
+    }
+
+    {
+        int overhead;
+        g_forkscan_autotune = 0 != get_int(getenv(env_autotune), 0);
+        // Percent of a CPU that collection may cost.
+        overhead = get_int(getenv(env_tune_overhead), DEFAULT_TUNE_OVERHEAD);
+        g_forkscan_tune_overhead = MAX_OF(MIN_OF(overhead, 100), 1);
+    }
 }
@@ -23,20 +23,121 @@ THE SOFTWARE.
 #ifndef _ENV_H_
 #define _ENV_H_ 1
 
+#include <stddef.h>
+
 #define MAX_THREAD_COUNT 256
 
 // # of ptrs a thread can "save up" before initiating a collection run.
 // The number of pointers per thread should be a power of 2 because we use
 // this number to do masking (to avoid the costly modulo operation).
+// Under FORKSCAN_AUTOTUNE, queues may be held to fewer (see tune.h).
+#define MIN_PTRS_PER_THREAD 1024
 extern int g_forkscan_ptrs_per_thread;
 
 // Whether to report application statistics before the program terminates.
 extern int g_forkscan_report_statistics;
 
 // How many collects can queue up before user threads get throttled.
-extern int g_forkscan_throttling_queue;
+// Tuned at runtime under FORKSCAN_AUTOTUNE.
+#define MAX_THROTTLING_QUEUE 32
+extern volatile int g_forkscan_throttling_queue;
 
 // Maximum number of children to fork to participate in a scan of memory.
-extern int g_forkscan_max_children;
+// Tuned at runtime under FORKSCAN_AUTOTUNE.
+extern volatile int g_forkscan_max_children;
+
+// Scanning: addresses set aside to be looked up together (up to
+// LOOKASIDE_SZ), the most memory a child claims at once, and the memory
+// it takes to be worth another child, in bytes.
+#define LOOKASIDE_SZ 0x4000
+#define DEFAULT_RANGE_SIZE (8 * 1024 * 1024)
+#define DEFAULT_CHILD_THRESHOLD (16 * 1024 * 1024)
+#define MIN_RANGE_SIZE_KB 1024
+#define MAX_RANGE_SIZE_KB (1024 * 1024)
+extern volatile int g_forkscan_lookaside;
+extern volatile size_t g_forkscan_range_size;
+extern volatile size_t g_forkscan_child_threshold;
+
+// Huge page policy for Forkscan's big buffers and advice for the heap.
+#define HUGE_PAGES_NONE 0
+#define HUGE_PAGES_THP 1     // madvise(MADV_HUGEPAGE).
+#define HUGE_PAGES_HUGETLB 2 // MAP_HUGETLB, falling back to THP.
+extern int g_forkscan_huge_pages;
+
+// Whether to scan MAP_SHARED heaps (anonymous, memfd, hugetlbfs).
+extern int g_forkscan_scan_shared;
+
+// Whether forkscan_malloc() uses the built-in slab allocator.
+extern int g_forkscan_slab;
+
+// Max pointers that can be spilled from full per-thread queues.
+extern int g_forkscan_spill_limit;
+
+// Reclaimed blocks a thread may cache per size class for forkscan_malloc().
+extern int g_forkscan_magazine_size;
+
+// Background threads that free retired memory, and how they're scheduled.
+extern int g_forkscan_freer_threads;
+extern const char *g_forkscan_freer_cpus;
+extern int g_forkscan_freer_nice;
+
+// Whether application threads help free, unless they've said otherwise
+// with forkscan_set_helping().  Read at every retire, so it can change.
+extern int g_forkscan_app_frees;
+
+// Most time a retire may spend free'ing on others' behalf, in ns.
+extern int g_forkscan_free_latency_ns;
+
+// Retirees a thread claims to free at a time (up to FREE_RANGE_SZ).
+extern volatile int g_forkscan_free_range;
+
+// How reclaimed blocks are cleared before they're reused, so stale
+// pointers in them don't keep anything alive.
+#define ZERO_FULL 0        // memset() the whole block.
+#define ZERO_NONE 1        // Leave it.  Risks false retention.
+#define ZERO_POINTERS 2    // Clear only words that look like pointers.
+#define ZERO_NONTEMPORAL 3 // Streaming stores that bypass the cache.
+#define ZERO_MADVISE 4     // MADV_DONTNEED whole pages, memset() the rest.
+extern int g_forkscan_zero;
+
+// Whether to free blocks on, and keep thread metadata on, their own node.
+extern int g_forkscan_numa;
+
+// Whether threads are stopped for snapshots at safepoints (allocation,
+// retirement, forkscan_safepoint()) instead of by signals.  Threads that
+// don't reach one in time are signalled anyway.
+extern int g_forkscan_safepoints;
+
+// Soft limit on retired-but-not-free'd bytes (forkscan_set_memory_target()).
+// 0 if there is none.
+extern volatile size_t g_forkscan_memory_target;
+
+// Iteration schedule on the GC thread: a period and a maximum time from
+// retire to scan, in ms (0 for none), and the fewest pending pointers
+// worth a fork on a period.
+#define DEFAULT_TRIGGER_MIN 1024
+extern int g_forkscan_period_ms;
+extern int g_forkscan_max_latency_ms;
+extern int g_forkscan_trigger_min;
+
+// Whether to watch for memory pressure (see pressure.h), and the stall, in
+// ms per 2s, that counts.
+#define DEFAULT_PRESSURE_STALL_MS 100
+extern int g_forkscan_pressure;
+extern int g_forkscan_pressure_stall_ms;
+
+// Whether to tune queue sizes, throttling and scan parallelism at runtime
+// (see tune.h), and the share of a CPU, in percent, collection may cost.
+#define DEFAULT_TUNE_OVERHEAD 5
+extern int g_forkscan_autotune;
+extern int g_forkscan_tune_overhead;
+
+// File of settings to apply at startup and whenever it changes (see
+// params.h), or NULL.
+extern const char *g_forkscan_config;
+
+// Whether blocking libc calls (poll(), epoll_wait(), nanosleep()) are
+// treated as blocking regions.
+extern int g_forkscan_wrap_blocking;
 
 #endif // !defined _ENV_H_
@@ -20,32 +20,57 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
-#define _GNU_SOURCE // For pthread_yield().
+#define _GNU_SOURCE // For pipe2().
 #include "alloc.h"
 #include <assert.h>
 #include "child.h"
 #include "env.h"
 #include <fcntl.h>
 #include "forkscan.h"
+#include "large.h"
+#include <limits.h>
+#include <linux/futex.h>
 #include <malloc.h>
+#include "params.h"
+#include "pressure.h"
 #include "proc.h"
 #include <pthread.h>
 #include "queue.h"
+#include <sched.h>
 #include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include "thread.h"
+#include "tune.h"
+#include "types.h"
 #include <unistd.h>
 
 #define MAX_FREE_LIST_LENGTH 128
 
 #define SAVINGS_THRESHOLD 2048
 
+// How long a thread waiting on an iteration sleeps before checking again.
+#define ITERATION_WAIT_NS (10 * 1000 * 1000)
+
 #define PIPE_READ 0
 #define PIPE_WRITE 1
 
+// Spins on the release flag before a stopped thread sleeps on it.
+#define STW_RELEASE_SPINS 1024
+
+// Finest granularity of the GC thread's own schedule.
+#define SCHEDULE_TICK_MIN_NS (1000 * 1000)
+
+// How often FORKSCAN_CONFIG is checked for changes, at least.
+#define CONFIG_CHECK_NS (1000 * 1000 * 1000)
+
+// Pause times are kept in buckets of powers of two microseconds.
+#define PAUSE_BUCKETS 32
+
 #ifndef NDEBUG
 #define assert_monotonicity(a, n)                       \
     __assert_monotonicity(a, n, __FILE__, __LINE__)
@@ -75,24 +100,36 @@ struct unref_config_t
     size_t min_val, max_val;
 };
 
-int g_frees_required = 8;
+// Work for the garbage collector: reclaimers push buffers onto a
+// lock-free stack, then bump g_waiting_collects, which the GC thread
+// sleeps on.  Throttled reclaimers sleep on g_collects_taken, which moves
+// each time the GC thread takes the stack.
+static addr_buffer_t *volatile g_addr_buffer;
+static addr_buffer_t *g_uncollected_data;
+static volatile int g_waiting_collects;  // A futex.
+static volatile int g_gc_waiting;        // GC thread is asleep on it.
+static volatile int g_collects_taken;    // A futex.
+static volatile int g_throttled;         // Reclaimers asleep on it.
 
-// For signaling the garbage collector with work to do.
-static pthread_mutex_t g_gc_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t g_gc_cond = PTHREAD_COND_INITIALIZER;
-
-static addr_buffer_t *g_addr_buffer, *g_uncollected_data;
-static volatile int g_waiting_collects;
-static pthread_mutex_t g_client_waiting_lock;
-static pthread_cond_t g_client_waiting_cond;
-
-static volatile int g_received_signal;
 static volatile size_t g_cleanup_counter;
-static enum { GC_NOT_WAITING,
-              GC_WAITING_FOR_WORK } g_gc_waiting = GC_WAITING_FOR_WORK;
+static volatile int g_stw_round;          // Snapshot being taken.
+static volatile int g_stw_release;        // A futex: last round released.
+static size_t g_pause_hist[PAUSE_BUCKETS];
+static size_t g_pause_max_ns;
 static size_t g_scan_max;
 static double g_total_fork_time;
 static pid_t child_pid;
+static volatile int g_process_dying;
+static volatile int g_iteration_count; // A futex.
+
+// Iterations the GC thread started on its own, by reason, and the times
+// it passed because too little was pending.
+static size_t g_last_iteration_ns;
+static size_t g_scheduled_period, g_scheduled_latency, g_scheduled_skipped;
+static size_t g_scheduled_pressure;
+static volatile int g_collection_requested;
+
+volatile size_t g_forkscan_oldest_retire_ns;
 
 size_t g_total_wait_time_ms = 0;
 
@@ -111,26 +148,89 @@ static void generate_minimap (addr_buffer_t *ab)
     }
 }
 
+/**
+ * Fill in the size and type of entry i from a sized pointer code.  Sizes
+ * that are unknown are left as zero.
+ */
+static void decode_size (addr_buffer_t *ab, int i, size_t code)
+{
+    unsigned short type = 0;
+    unsigned int size = code << 3;
+
+    if (code & TYPED_PTR_FLAG) {
+        type = code & ~TYPED_PTR_FLAG;
+        size = forkscan_types_get(type)->size;
+    }
+    ab->sizes[i] = size;
+    if (ab->types) ab->types[i] = type;
+}
+
+/**
+ * The reverse of decode_size().  Sizes too big to encode come out as zero.
+ */
+static size_t encode_size (addr_buffer_t *ab, int i)
+{
+    if (ab->types && ab->types[i]) return TYPED_PTR_FLAG | ab->types[i];
+    return ab->sizes[i] <= SIZED_PTR_MAX ? ab->sizes[i] >> 3 : 0;
+}
+
+static void unpack_sized_ptrs (addr_buffer_t *ab, size_t *vals, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i) {
+        ab->addrs[ab->n_addrs] = SIZED_PTR_ADDR(vals[i]);
+        decode_size(ab, ab->n_addrs, SIZED_PTR_CODE(vals[i]));
+        ++ab->n_addrs;
+    }
+}
+
+/**
+ * Sort the addresses, carrying their sizes and types along.  Each entry is
+ * packed into a single word, ordered by address, so the sort itself is
+ * unchanged.  Sizes that weren't supplied at retire time are looked up in
+ * the same pass that unpacks them, so the scan never has to ask the
+ * allocator.
+ */
+static void sort_addrs (addr_buffer_t *ab)
+{
+    const int shift = 64 - SIZED_PTR_SHIFT;
+    int i;
+
+    for (i = 0; i < ab->n_addrs; ++i) {
+        ab->addrs[i] = (ab->addrs[i] << shift) | encode_size(ab, i);
+    }
+    forkscan_util_sort(ab->addrs, ab->n_addrs);
+    for (i = 0; i < ab->n_addrs; ++i) {
+        decode_size(ab, i, ab->addrs[i] & (((size_t)1 << shift) - 1));
+        ab->addrs[i] >>= shift;
+        if (0 == ab->sizes[i]) {
+            ab->sizes[i] = USABLE_SIZE((void*)ab->addrs[i]);
+        }
+    }
+}
+
 static addr_buffer_t *aggregate_addrs (addr_buffer_t *old,
                                        addr_buffer_t *data_list)
 {
     addr_buffer_t *ret, *tmp;
     size_t n_addrs = 0;
-    int list_count = 0;
 
     if (old) {
         n_addrs = old->n_addrs;
     }
 
+    // Pointers spilled by threads whose queues were full.
+    int n_spilled;
+    spill_chunk_t *spill = forkscan_buffer_take_spill(&n_spilled), *sc;
+    n_addrs += n_spilled;
+
     tmp = data_list;
     do {
         n_addrs += tmp->n_addrs;
-        ++list_count;
     } while ((tmp = tmp->next));
-    // FIXME: This g_frees_required calculation no longer works as planned.
-    g_frees_required = MAX_OF(list_count * 8, 8);
 
-    assert(n_addrs != 0);
+    // Note: n_addrs may be zero if the iteration was started on account of
+    // large objects.
 
     if (old && old->capacity > n_addrs) {
         ret = old;
@@ -140,33 +240,93 @@ static addr_buffer_t *aggregate_addrs (addr_buffer_t *old,
         ret->next = NULL;
         if (old) {
             memcpy(ret->addrs, old->addrs, old->n_addrs * sizeof(size_t));
+            memcpy(ret->sizes, old->sizes,
+                   old->n_addrs * sizeof(unsigned int));
+            memcpy(ret->types, old->types,
+                   old->n_addrs * sizeof(unsigned short));
             ret->n_addrs = old->n_addrs;
             forkscan_release_buffer(old);
         }
     }
 
-    // Copy the addresses into the aggregate buffer.
+    // Copy the addresses into the aggregate buffer, splitting off sizes.
     while (data_list) {
-        memcpy(&ret->addrs[ret->n_addrs],
-               data_list->addrs,
-               data_list->n_addrs * sizeof(size_t));
-        ret->n_addrs += data_list->n_addrs;
+        unpack_sized_ptrs(ret, data_list->addrs, data_list->n_addrs);
         data_list = data_list->next;
     }
+    for (sc = spill; sc != NULL; sc = sc->next) {
+        unpack_sized_ptrs(ret, sc->addrs, sc->n_addrs);
+    }
+    forkscan_buffer_release_spill(spill);
     assert(ret->n_addrs == n_addrs);
 
     return ret;
 }
 
+/**
+ * Give the allocator's heap a nudge toward transparent huge pages.  Fewer
+ * page table entries means a cheaper fork() and fewer TLB misses in the
+ * scan.  Anonymous, private, writable ranges are the heap candidates.
+ */
+static int advise_heap_range (void *ignored,
+                              size_t low,
+                              size_t high,
+                              const char *bits,
+                              const char *path)
+{
+    if (bits[1] != 'w' || bits[3] != 'p') return 1;
+    if (path[0] != '\0' && 0 != strcmp(path, "[heap]")) return 1;
+    forkscan_alloc_advise_heap(low, high);
+    return 1;
+}
+
+/**
+ * Add a stop-the-world pause of the given length to the histogram.
+ */
+static void record_pause (size_t ns)
+{
+    size_t us = ns / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    ++g_pause_hist[MIN_OF(bucket, PAUSE_BUCKETS - 1)];
+    if (ns > g_pause_max_ns) g_pause_max_ns = ns;
+}
+
+/**
+ * Wait for the child to finish scanning shared memory.  Fail if it dies
+ * first, rather than keeping the application stopped forever.
+ */
+static void wait_for_shared_scan (addr_buffer_t *ab)
+{
+    while (!ab->shared_scanned) {
+        // Reaped here, or by the kernel if SIGCHLD is ignored.
+        if (0 != waitpid(child_pid, NULL, WNOHANG) && !ab->shared_scanned) {
+            if (g_process_dying) for (;;) pause();
+            forkscan_fatal("Collection failed (child died).\n");
+        }
+        sched_yield();
+    }
+}
+
 static void reclaim_iteration (addr_buffer_t *ab)
 {
     addr_buffer_t *working_data;
     addr_buffer_t *deadrefs = NULL;
-    int sig_count;
     int pipefd[2];
+    size_t n_retired;
 
+    n_retired = g_uncollected_data ? g_uncollected_data->n_addrs : 0;
     working_data = aggregate_addrs(g_uncollected_data, ab);
     g_uncollected_data = NULL;
+    n_retired = working_data->n_addrs - n_retired;
+    working_data->shared_scanned = 0;
+    forkscan_large_snapshot();
+
+    if (g_forkscan_huge_pages != HUGE_PAGES_NONE) {
+        forkscan_proc_map_iterate_and_close(advise_heap_range, NULL);
+    }
+
+    // The child may not allocate: a stopped thread could hold the lock.
+    forkscan_buffer_make_dead_references();
 
     // Open a pipe for communication between parent and child.
     if (0 != pipe2(pipefd, O_DIRECT)) {
@@ -175,24 +335,34 @@ static void reclaim_iteration (addr_buffer_t *ab)
 
     // Send out signals.  When everybody is waiting at the line, fork the
     // process for the snapshot.
-    size_t start, end;
-    g_received_signal = 0;
+    size_t start, end, pause_start, pause_ns;
+    int round = g_stw_round + 1;
     start = forkscan_rdtsc();
-    sig_count = forkscan_proc_signal(SIGFORKSCAN);
-    while (g_received_signal < sig_count) pthread_yield();
-    deadrefs = forkscan_buffer_get_dead_references();
+    pause_start = forkscan_util_ns();
+    g_stw_round = round;
+    __sync_synchronize(); // Against forkscan_exit_blocking().
+    forkscan_proc_signal_tree(g_forkscan_safepoints ? 0 : SIGFORKSCAN, round);
+    forkscan_proc_wait_for_acks(round);
     child_pid = fork();
 
     if (child_pid == -1) {
         forkscan_fatal("Collection failed (fork).\n");
     } else if (child_pid == 0) {
+        // The retiree slot table is frozen in the snapshot, so the dead
+        // references can be gathered here, where nobody is waiting on it.
+        // The aggregates it points to are MAP_SHARED, though, and freeing
+        // threads go on clearing addresses in them once they're released.
+        // That's harmless: an address is cleared before its block is
+        // free'd, so one that is still there was dead when we forked.
+        deadrefs = forkscan_buffer_get_dead_references();
+
         // Sort the addresses and generate the minimap for the scanner.
-        forkscan_util_sort(working_data->addrs, working_data->n_addrs);
+        sort_addrs(working_data);
         assert_monotonicity(working_data->addrs, working_data->n_addrs);
         generate_minimap(working_data);
         if (deadrefs->n_addrs > 1) {
             // No minimap for deadrefs.
-            forkscan_util_sort(deadrefs->addrs, deadrefs->n_addrs);
+            sort_addrs(deadrefs);
             assert_monotonicity(deadrefs->addrs, deadrefs->n_addrs);
         }
 
@@ -204,7 +374,19 @@ static void reclaim_iteration (addr_buffer_t *ab)
         exit(0);
     }
 
+    if (g_forkscan_scan_shared) {
+        // Shared memory gets no COW snapshot, so everybody stays stopped
+        // until the child has scanned it.
+        wait_for_shared_scan(working_data);
+    }
+
+    // Let everybody go at once.
     ++g_cleanup_counter;
+    g_stw_release = round;
+    syscall(SYS_futex, &g_stw_release, FUTEX_WAKE_PRIVATE, INT_MAX,
+            NULL, NULL, 0);
+    pause_ns = forkscan_util_ns() - pause_start;
+    record_pause(pause_ns);
     close(pipefd[PIPE_WRITE]);
     end = forkscan_rdtsc();
     g_total_fork_time += end - start;
@@ -221,13 +403,18 @@ static void reclaim_iteration (addr_buffer_t *ab)
     size_t bytes_scanned;
     if (sizeof(size_t) != read(pipefd[PIPE_READ], &bytes_scanned,
                                sizeof(size_t))) {
+        // The child is killed on the way out.  Let the process finish dying.
+        if (g_process_dying) for (;;) pause();
         forkscan_fatal("Failed to read from child.\n");
     }
     if (bytes_scanned > g_scan_max) g_scan_max = bytes_scanned;
     close(pipefd[PIPE_READ]);
+    forkscan_tune_iteration(n_retired, pause_ns,
+                            forkscan_util_ns() - pause_start - pause_ns,
+                            bytes_scanned);
 
-    // Make the unreferenced nodes, here, available for free'ing.
-    forkscan_buffer_push_back(working_data);
+    // Unreferenced large objects go straight back to the OS.
+    forkscan_large_sweep();
 
     // Pull out all the externally-referenced addresses so they can be
     // included in the next collection round.
@@ -237,11 +424,18 @@ static void reclaim_iteration (addr_buffer_t *ab)
     int i;
     for (i = 0; i < working_data->n_addrs; ++i) {
         if ((working_data->addrs[i] & 0x1) == 0) continue;
+        g_uncollected_data->sizes[g_uncollected_data->n_addrs] =
+            working_data->sizes[i];
+        g_uncollected_data->types[g_uncollected_data->n_addrs] =
+            working_data->types[i];
         g_uncollected_data->addrs[g_uncollected_data->n_addrs++] =
             PTR_MASK(working_data->addrs[i]);
     }
 
-    forkscan_buffer_unref_buffer(working_data);
+    // Make the unreferenced nodes, here, available for free'ing.  The
+    // buffer is theirs from here on.
+    forkscan_util_pace_iteration(n_retired, working_data->n_addrs);
+    forkscan_buffer_push_back(working_data);
 }
 
 /****************************************************************************/
@@ -253,12 +447,47 @@ static void reclaim_iteration (addr_buffer_t *ab)
  */
 void forkscan_acknowledge_signal ()
 {
-    size_t old_counter;
+    thread_data_t *td = forkscan_thread_get_td();
+    int round = g_stw_round;
+    int i;
+
+    // A repeat signal for a round this thread already sat out.
+    if (NULL == td || td->stw_ack == round) return;
+
+    // Acknowledge the signal and wait for the snapshot to complete.  Most
+    // pauses are short, so spin a little before going to sleep.
+    td->stw_ack = round;
+    for (i = 0; i < STW_RELEASE_SPINS && g_stw_release != round; ++i) {
+        __builtin_ia32_pause();
+    }
+    while (1) {
+        int released = g_stw_release;
+        if (released == round) break;
+        syscall(SYS_futex, &g_stw_release, FUTEX_WAIT_PRIVATE, released,
+                NULL, NULL, 0);
+    }
+}
+
+/**
+ * If a snapshot is being taken, join the threads stopped for it and wait
+ * until it's done.
+ */
+void forkscan_wait_for_snapshot ()
+{
+    if (g_stw_release != g_stw_round) forkscan_acknowledge_signal();
+}
 
-    // Acknowledge the signal and wait for the snapshot to complete.
-    old_counter = g_cleanup_counter;
-    __sync_fetch_and_add(&g_received_signal, 1);
-    while (old_counter == g_cleanup_counter) usleep(1);
+/**
+ * Pass the GC thread's signal on to the threads below this one in the
+ * relay tree, once per round.
+ */
+void forkscan_relay_signal ()
+{
+    thread_data_t *td = forkscan_thread_get_td();
+    int round = g_stw_round;
+    if (NULL == td || td->stw_relayed == round) return;
+    td->stw_relayed = round;
+    forkscan_proc_relay_signal(td);
 }
 
 /**
@@ -266,31 +495,172 @@ void forkscan_acknowledge_signal ()
  */
 void forkscan_initiate_collection (addr_buffer_t *ab, int auto_run, int force)
 {
+    addr_buffer_t *head;
+
     // Add the buffer into the queue.  Notify the Forkscan thread there is work
     // waiting if we're in automatic iterations mode, or if the user initiated
     // the collection.
-    pthread_mutex_lock(&g_gc_mutex);
-    if (auto_run || force) ++g_waiting_collects;
-    ab->next = g_addr_buffer;
-    g_addr_buffer = ab;
-    if (g_gc_waiting == GC_WAITING_FOR_WORK && (auto_run || force)) {
-        pthread_cond_signal(&g_gc_cond);
+    do {
+        head = g_addr_buffer;
+        ab->next = head;
+    } while (!__sync_bool_compare_and_swap(&g_addr_buffer, head, ab));
+    if (auto_run || force) {
+        __sync_fetch_and_add(&g_waiting_collects, 1);
+        if (g_gc_waiting) {
+            syscall(SYS_futex, &g_waiting_collects, FUTEX_WAKE_PRIVATE, 1,
+                    NULL, NULL, 0);
+        }
     }
-    pthread_mutex_unlock(&g_gc_mutex);
 
     if (auto_run > 0) {
         // Only throttle if we are in automatic mode - in which case Forkscan
         // provides memory limit guarantees.  If the user is manually
         // controlling reclamation iterations, all memory guarantees are out
         // the window.
+        forkscan_thread_enter_blocking();
         while (g_waiting_collects >= g_forkscan_throttling_queue) {
-            pthread_mutex_lock(&g_client_waiting_lock);
+            int taken = g_collects_taken;
+            __sync_fetch_and_add(&g_throttled, 1);
             if (g_waiting_collects >= g_forkscan_throttling_queue) {
-                pthread_cond_wait(&g_client_waiting_cond,
-                                  &g_client_waiting_lock);
+                syscall(SYS_futex, &g_collects_taken, FUTEX_WAIT_PRIVATE,
+                        taken, NULL, NULL, 0);
             }
-            pthread_mutex_unlock(&g_client_waiting_lock);
+            __sync_fetch_and_sub(&g_throttled, 1);
         }
+        forkscan_thread_exit_blocking();
+    }
+}
+
+/**
+ * Return the number of iterations that have completed.
+ */
+int forkscan_iteration_count ()
+{
+    return g_iteration_count;
+}
+
+/**
+ * Sleep until the iteration count moves past "count".  This may return
+ * early, so callers should check their condition and call again.
+ */
+void forkscan_wait_for_iteration (int count)
+{
+    // Wake up now and then regardless.  If iterations are manual, none may
+    // be coming, and the caller needs to try reclaiming for itself.
+    struct timespec timeout = { 0, ITERATION_WAIT_NS };
+    forkscan_thread_enter_blocking();
+    syscall(SYS_futex, &g_iteration_count, FUTEX_WAIT_PRIVATE, count,
+            &timeout, NULL, 0);
+    forkscan_thread_exit_blocking();
+}
+
+/**
+ * Take every buffer the reclaimers have handed over, and let the throttled
+ * ones go.
+ */
+static addr_buffer_t *take_collects ()
+{
+    addr_buffer_t *ab;
+
+    // The count is cleared first so that nothing pushed after the stack is
+    // taken goes uncounted.
+    __sync_lock_test_and_set(&g_waiting_collects, 0);
+    __sync_synchronize();
+    ab = __sync_lock_test_and_set(&g_addr_buffer, NULL);
+    __sync_fetch_and_add(&g_collects_taken, 1);
+    if (g_throttled) {
+        syscall(SYS_futex, &g_collects_taken, FUTEX_WAKE_PRIVATE, INT_MAX,
+                NULL, NULL, 0);
+    }
+    return ab;
+}
+
+/**
+ * How long the GC thread may sleep before it has to check its schedule,
+ * in ns.  0 if it has none.
+ */
+static size_t schedule_tick ()
+{
+    size_t tick = 0;
+    if (g_forkscan_period_ms) tick = (size_t)g_forkscan_period_ms * 1000000;
+    if (g_forkscan_max_latency_ms) {
+        // Check often enough not to overshoot by much.
+        size_t latency_tick = (size_t)g_forkscan_max_latency_ms * 250000;
+        tick = tick ? MIN_OF(tick, latency_tick) : latency_tick;
+    }
+    // A config file is checked for changes whenever the thread wakes.
+    if (0 == tick && g_forkscan_config) tick = CONFIG_CHECK_NS;
+    return tick ? MAX_OF(tick, SCHEDULE_TICK_MIN_NS) : 0;
+}
+
+/**
+ * Start an iteration without waiting for a queue to fill, if a retire has
+ * waited too long, one was requested, or the period is up and enough is
+ * pending to be worth a fork.  Return the gathered pointers, or NULL.
+ */
+static addr_buffer_t *scheduled_collection ()
+{
+    size_t now = forkscan_util_ns();
+    size_t oldest = g_forkscan_oldest_retire_ns;
+    size_t trigger_min = (size_t)g_forkscan_trigger_min;
+    int by_latency, by_period, by_request;
+    addr_buffer_t *ab;
+
+    by_request = g_collection_requested
+        && __sync_lock_test_and_set(&g_collection_requested, 0);
+    by_latency = g_forkscan_max_latency_ms && oldest && now > oldest
+        && now - oldest >= (size_t)g_forkscan_max_latency_ms * 1000000;
+    by_period = g_forkscan_period_ms
+        && now - g_last_iteration_ns >= (size_t)g_forkscan_period_ms * 1000000;
+    if (!by_latency && !by_period && !by_request) return NULL;
+
+    if (by_request) {
+        // Memory is short: give back what the allocator is holding, and
+        // take whatever is pending, however little.
+        forkscan_util_trim();
+        trigger_min = 1;
+    } else if (by_latency) {
+        // A slow retirer's few pointers mustn't wait forever.
+        trigger_min = 1;
+    }
+    if (forkscan_pending_retires() < trigger_min) {
+        // Not worth it yet.  Give the next period a fresh start.
+        ++g_scheduled_skipped;
+        if (by_period) g_last_iteration_ns = now;
+        return NULL;
+    }
+    ab = forkscan_gather_retires();
+    if (NULL == ab) return NULL; // A reclaimer beat us to it.
+    if (by_request) ++g_scheduled_pressure;
+    else if (by_latency) ++g_scheduled_latency;
+    else ++g_scheduled_period;
+    return ab;
+}
+
+/**
+ * Ask the GC thread for an iteration, whatever its schedule, and wake the
+ * threads waiting on one so they can free what they have.
+ */
+void forkscan_request_collection ()
+{
+    g_collection_requested = 1;
+    __sync_synchronize();
+    if (g_gc_waiting) {
+        syscall(SYS_futex, &g_waiting_collects, FUTEX_WAKE_PRIVATE, 1,
+                NULL, NULL, 0);
+    }
+    syscall(SYS_futex, &g_iteration_count, FUTEX_WAKE_PRIVATE, INT_MAX,
+            NULL, NULL, 0);
+}
+
+/**
+ * Wake the GC thread, if it's asleep, so it picks up a new schedule.
+ */
+void forkscan_reschedule ()
+{
+    if (g_gc_waiting) {
+        syscall(SYS_futex, &g_waiting_collects, FUTEX_WAKE_PRIVATE, 1,
+                NULL, NULL, 0);
     }
 }
 
@@ -300,35 +670,70 @@ void forkscan_initiate_collection (addr_buffer_t *ab, int auto_run, int force)
 void *forkscan_thread (void *ignored)
 {
     addr_buffer_t *ab;
+    size_t tick;
+    struct timespec timeout;
 
+    g_last_iteration_ns = forkscan_util_ns();
     while ((1)) {
-        pthread_mutex_lock(&g_gc_mutex);
-        if (g_waiting_collects < 1) {
-            // Wait for somebody to come up with a set of addresses for us to
-            // collect.
-            g_gc_waiting = GC_WAITING_FOR_WORK;
-            pthread_cond_wait(&g_gc_cond, &g_gc_mutex);
-            g_gc_waiting = GC_NOT_WAITING;
+        // Wait for somebody to come up with a set of addresses for us to
+        // collect, or for the schedule to call for an iteration.
+        ab = NULL;
+        while (NULL == ab && g_waiting_collects < 1) {
+            // The schedule may have been changed (forkscan_set_param()).
+            forkscan_params_reload();
+            tick = schedule_tick();
+            timeout.tv_sec = tick / 1000000000;
+            timeout.tv_nsec = tick % 1000000000;
+            g_gc_waiting = 1;
+            __sync_synchronize();
+            if (!g_collection_requested) {
+                syscall(SYS_futex, &g_waiting_collects, FUTEX_WAIT_PRIVATE, 0,
+                        tick ? &timeout : NULL, NULL, 0);
+            }
+            g_gc_waiting = 0;
+            if ((tick || g_collection_requested) && g_waiting_collects < 1) {
+                ab = scheduled_collection();
+            }
         }
+        if (NULL == ab) ab = take_collects();
 
-        assert(g_addr_buffer);
-        ab = g_addr_buffer;
-        g_addr_buffer = NULL;
-        if (g_waiting_collects >= g_forkscan_throttling_queue) {
-            g_waiting_collects = 0;
-            pthread_mutex_lock(&g_client_waiting_lock);
-            pthread_cond_broadcast(&g_client_waiting_cond);
-            pthread_mutex_unlock(&g_client_waiting_lock);
-        } else g_waiting_collects = 0;
-
-        pthread_mutex_unlock(&g_gc_mutex);
+        // The count can run ahead of the buffers it counts.
+        if (NULL == ab) continue;
 
+        // A fork under a tight memory limit can tip the process over it.
+        forkscan_params_reload();
+        forkscan_pressure_wait_for_headroom();
         reclaim_iteration(ab);
+        g_last_iteration_ns = forkscan_util_ns();
+
+        // Wake the threads that were waiting for room to retire.
+        __sync_fetch_and_add(&g_iteration_count, 1);
+        syscall(SYS_futex, &g_iteration_count, FUTEX_WAKE_PRIVATE, INT_MAX,
+                NULL, NULL, 0);
     }
 
     return NULL;
 }
 
+/**
+ * Set the allocator, as with forkscan_set_allocator(), along with optional
+ * faster ways to free: free_sized (like sdallocx() or free_sized()) gets
+ * the block's size, and free_batch gets a run of blocks in address order.
+ * Either may be NULL.
+ */
+void forkscan_set_allocator_ext (void *(*alloc) (size_t),
+                                 void (*dealloc) (void *),
+                                 size_t (*usable_size) (void *),
+                                 void (*free_sized) (void *, size_t),
+                                 void (*free_batch) (void **, size_t))
+{
+    __forkscan_alloc = alloc;
+    __forkscan_free = dealloc;
+    __forkscan_usable_size = usable_size;
+    __forkscan_free_sized = free_sized;
+    __forkscan_free_batch = free_batch;
+}
+
 /**
  * Set the allocator for Forkscan to use: malloc, free, malloc_usable_size.
  */
@@ -336,9 +741,7 @@ void forkscan_set_allocator (void *(*alloc) (size_t),
                              void (*dealloc) (void *),
                              size_t (*usable_size) (void *))
 {
-    __forkscan_alloc = alloc;
-    __forkscan_free = dealloc;
-    __forkscan_usable_size = usable_size;
+    forkscan_set_allocator_ext(alloc, dealloc, usable_size, NULL, NULL);
 }
 
 /**
@@ -349,6 +752,7 @@ void forkscan_print_statistics ()
     char statm[256];
     size_t bytes_read;
     FILE *fp;
+    int i;
 
     fp = fopen("/proc/self/statm", "r");
     if (NULL == fp) {
@@ -368,11 +772,41 @@ void forkscan_print_statistics ()
            g_cleanup_counter == 0 ? 0
            : ((int)(g_total_fork_time / g_cleanup_counter)));
     printf("wait-time: %zu\n", g_total_wait_time_ms);
+    printf("pause-max-us: %zu\n", g_pause_max_ns / 1000);
+    printf("pause-hist-us:");
+    for (i = 0; i < PAUSE_BUCKETS; ++i) {
+        if (0 == g_pause_hist[i]) continue;
+        printf(" <%zu:%zu", (size_t)1 << i, g_pause_hist[i]);
+    }
+    printf("\n");
+    printf("scheduled-period: %zu\n", g_scheduled_period);
+    printf("scheduled-latency: %zu\n", g_scheduled_latency);
+    printf("scheduled-skipped: %zu\n", g_scheduled_skipped);
+    if (g_forkscan_pressure) {
+        printf("scheduled-pressure: %zu\n", g_scheduled_pressure);
+        printf("pressure-events: %zu\n", g_forkscan_pressure_events);
+        printf("pressure-holds: %zu\n", g_forkscan_pressure_holds);
+    }
+    forkscan_tune_print_statistics();
+}
+
+/**
+ * Copy the stop-the-world pause histogram into counts: counts[0] is pauses
+ * under 1us and counts[i] those under 2^i us (but at least 2^(i-1)).
+ * @return The number of buckets Forkscan keeps.
+ */
+__attribute__((visibility("default")))
+int forkscan_pause_histogram (unsigned long long *counts, int n)
+{
+    int i;
+    for (i = 0; i < n && i < PAUSE_BUCKETS; ++i) counts[i] = g_pause_hist[i];
+    return PAUSE_BUCKETS;
 }
 
 __attribute__((destructor))
 static void process_death ()
 {
+    g_process_dying = 1;
     if (child_pid > 0) {
         // There's still an outstanding child.  Kill it.
         kill(child_pid, 9);
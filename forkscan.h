@@ -34,11 +34,62 @@ THE SOFTWARE.
  */
 void forkscan_acknowledge_signal ();
 
+/**
+ * If a snapshot is being taken, join the threads stopped for it and wait
+ * until it's done.
+ */
+void forkscan_wait_for_snapshot ();
+
+/**
+ * Pass the GC thread's signal on to the threads below this one in the
+ * relay tree, once per round.
+ */
+void forkscan_relay_signal ();
+
 /**
  * Pass a list of pointers to the reclamation thread for it to collect.
  */
 void forkscan_initiate_collection (addr_buffer_t *ab, int auto_run, int force);
 
+/**
+ * Return the number of iterations that have completed.
+ */
+int forkscan_iteration_count ();
+
+/**
+ * Sleep until the iteration count moves past "count".  This may return
+ * early, so callers should check their condition and call again.
+ */
+void forkscan_wait_for_iteration (int count);
+
+/**
+ * When the oldest retire not yet gathered for an iteration happened, in
+ * ns, or 0.  Only kept up if FORKSCAN_MAX_LATENCY_MS is set.
+ */
+extern volatile size_t g_forkscan_oldest_retire_ns;
+
+/**
+ * Return the number of pointers waiting in threads' queues (frontend.c).
+ */
+size_t forkscan_pending_retires ();
+
+/**
+ * Gather every thread's queue into a buffer for an iteration, as a
+ * reclaimer would.  Return NULL if a reclaimer is already at it
+ * (frontend.c).
+ */
+addr_buffer_t *forkscan_gather_retires ();
+
+/**
+ * Ask the GC thread for an iteration now, whatever its schedule.
+ */
+void forkscan_request_collection ();
+
+/**
+ * Wake the GC thread, if it's asleep, so it picks up a new schedule.
+ */
+void forkscan_reschedule ();
+
 /**
  * Garbage-collector thread.
  */
@@ -0,0 +1,142 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE // For pthread_setaffinity_np().
+#include "env.h"
+#include "forkscan.h"
+#include "freer.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "thread.h"
+#include <unistd.h>
+#include "util.h"
+
+// Time a freer spends free'ing between checks for the GC thread's signal.
+#define FREER_BUDGET_NS 100000
+
+/****************************************************************************/
+/*                                 Globals                                  */
+/****************************************************************************/
+
+// CPUs named in FORKSCAN_FREER_CPUS, in order.
+static int g_cpus[CPU_SETSIZE];
+static int g_n_cpus;
+
+/****************************************************************************/
+/*                              Configuration.                              */
+/****************************************************************************/
+
+/**
+ * Parse a CPU list like "0,2-3" into g_cpus.  Anything unparseable ends
+ * the list.
+ */
+static void parse_cpus (const char *list)
+{
+    while (list && *list) {
+        char *end;
+        long low = strtol(list, &end, 10), high = low;
+        if (end == list) break;
+        if ('-' == *end) {
+            list = end + 1;
+            high = strtol(list, &end, 10);
+            if (end == list) break;
+        }
+        for (; low <= high; ++low) {
+            if (low < 0 || low >= CPU_SETSIZE || g_n_cpus == CPU_SETSIZE) {
+                continue;
+            }
+            g_cpus[g_n_cpus++] = (int)low;
+        }
+        list = ',' == *end ? end + 1 : NULL;
+    }
+}
+
+/**
+ * Pin the calling freer to its CPU, if there's a list, and set its nice
+ * level.  Failures are reported, but the thread runs regardless.
+ */
+static void apply_schedule (int id)
+{
+    if (g_n_cpus > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(g_cpus[id % g_n_cpus], &set);
+        if (0 != pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+            forkscan_diagnostic("Unable to pin freer %d to CPU %d.\n",
+                                id, g_cpus[id % g_n_cpus]);
+        }
+    }
+    if (0 != g_forkscan_freer_nice) {
+        // On Linux, the nice level is per-thread.
+        if (0 != setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid),
+                             g_forkscan_freer_nice)) {
+            forkscan_diagnostic("Unable to set freer %d nice level to %d.\n",
+                                id, g_forkscan_freer_nice);
+        }
+    }
+}
+
+/****************************************************************************/
+/*                              Freer threads.                              */
+/****************************************************************************/
+
+static void *freer_thread (void *arg)
+{
+    thread_data_t *td = forkscan_thread_get_td();
+
+    apply_schedule((int)(size_t)arg);
+    td->helps_free = 1;
+
+    while (1) {
+        int iteration = forkscan_iteration_count();
+        if (td->retiree_buffer || forkscan_buffer_has_retirees()) {
+            forkscan_freer_help(td, FREER_BUDGET_NS);
+        } else {
+            // Nothing left.  The next batch shows up with an iteration.
+            forkscan_wait_for_iteration(iteration);
+        }
+    }
+
+    return NULL;
+}
+
+void forkscan_freer_start ()
+{
+    int i;
+
+    if (0 == g_forkscan_freer_threads) return;
+    parse_cpus(g_forkscan_freer_cpus);
+
+    for (i = 0; i < g_forkscan_freer_threads; ++i) {
+        pthread_t tid;
+        // pthread_create() is the wrapped version, so the freer gets its
+        // thread metadata and answers the GC thread's signals like any
+        // other thread.
+        if (0 != pthread_create(&tid, NULL, freer_thread, (void*)(size_t)i)) {
+            forkscan_fatal("Unable to start freer thread.\n");
+        }
+        pthread_detach(tid);
+    }
+}
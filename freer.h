@@ -0,0 +1,47 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Module Description:
+   Background freer threads (FORKSCAN_FREER_THREADS).  Each one is an
+   ordinary Forkscan thread that drains the retiree buffers left by every
+   iteration, so memory is released even when the application stops
+   retiring, and application threads can stop helping altogether.
+ */
+
+#ifndef _FREER_H_
+#define _FREER_H_
+
+#include "util.h"
+
+/**
+ * Start the configured number of freer threads.  Called once, from the
+ * main thread, before the user's main() runs.
+ */
+void forkscan_freer_start ();
+
+/**
+ * Spend up to budget_ns free'ing retired memory on td's behalf,
+ * acknowledging any signal from the GC thread that arrives in the meantime.
+ */
+void forkscan_freer_help (thread_data_t *td, size_t budget_ns);
+
+#endif // !defined _FREER_H_
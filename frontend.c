@@ -25,11 +25,16 @@ THE SOFTWARE.
 #include <assert.h>
 #include "child.h"
 #include "env.h"
+#include <errno.h>
 #include "forkscan.h"
+#include "freer.h"
+#include "large.h"
+#include "params.h"
 #include "proc.h"
 #include <pthread.h>
 #include <string.h>
 #include "thread.h"
+#include "types.h"
 #include <unistd.h>
 #include "util.h"
 
@@ -58,6 +63,26 @@ static volatile __thread int g_in_malloc = 0;
 static __thread int g_waiting_to_fork = 0;
 static volatile int g_force_iteration = 0;
 
+/****************************************************************************/
+/*                                Safepoints                                */
+/****************************************************************************/
+
+/**
+ * Called where this thread holds no allocator locks.  Stop for a snapshot
+ * if the GC thread is waiting on this thread: a signal may have come in
+ * while it was in the allocator, or, in safepoint mode, no signal is sent
+ * and the thread has to check.
+ */
+static inline void safepoint ()
+{
+    if (g_waiting_to_fork) {
+        g_waiting_to_fork = 0;
+        forkscan_acknowledge_signal();
+    } else if (g_forkscan_safepoints) {
+        forkscan_wait_for_snapshot();
+    }
+}
+
 /****************************************************************************/
 /*                                Reclaimer.                                */
 /****************************************************************************/
@@ -77,7 +102,10 @@ static void generate_working_pointers_list (addr_buffer_t *ab)
     ENDFOREACH_IN_THREAD_LIST(td, thread_list);
 
     ab->n_addrs = n;
-    assert(!forkscan_queue_is_full(&forkscan_thread_get_td()->ptr_list));
+    assert(NULL == forkscan_thread_get_td()
+           || !forkscan_queue_is_full(&forkscan_thread_get_td()->ptr_list));
+    forkscan_util_memory_collected();
+    g_forkscan_oldest_retire_ns = 0;
 }
 
 static void become_reclaimer ()
@@ -104,6 +132,36 @@ static void become_reclaimer ()
     forkscan_thread_cleanup_release();
 }
 
+/**
+ * Return the number of pointers waiting in threads' queues.
+ */
+size_t forkscan_pending_retires ()
+{
+    thread_list_t *thread_list = forkscan_proc_get_thread_list();
+    thread_data_t *td;
+    size_t n = 0;
+
+    FOREACH_IN_THREAD_LIST(td, thread_list)
+        n += forkscan_queue_length(&td->ptr_list);
+    ENDFOREACH_IN_THREAD_LIST(td, thread_list);
+    return n;
+}
+
+/**
+ * Gather every thread's queue into a buffer for an iteration, as a
+ * reclaimer would.  Return NULL if a reclaimer is already at it.
+ */
+addr_buffer_t *forkscan_gather_retires ()
+{
+    addr_buffer_t *ab;
+
+    if (!forkscan_thread_cleanup_try_acquire()) return NULL;
+    ab = forkscan_make_reclaimer_buffer();
+    generate_working_pointers_list(ab);
+    forkscan_thread_cleanup_release();
+    return ab;
+}
+
 /****************************************************************************/
 /*                            Bystander threads.                            */
 /****************************************************************************/
@@ -114,26 +172,39 @@ static void yield (size_t n_yields)
     //if (n_yields > 10) usleep(MIN_OF(n_yields, 100));
     //else pthread_yield();
     g_in_malloc = 1;
-    forkscan_util_free_ptrs(forkscan_thread_get_td());
+    forkscan_util_free_ptrs(forkscan_thread_get_td(),
+                            g_forkscan_free_latency_ns);
     g_in_malloc = 0;
-    if (g_waiting_to_fork) {
-        g_waiting_to_fork = 0;
-        forkscan_acknowledge_signal();
-    }
+    safepoint();
     pthread_yield();
 }
 
+/**
+ * Spend up to budget_ns free'ing retired memory on td's behalf,
+ * acknowledging any signal from the GC thread that arrives in the meantime.
+ */
+void forkscan_freer_help (thread_data_t *td, size_t budget_ns)
+{
+    g_in_malloc = 1;
+    forkscan_util_free_ptrs(td, budget_ns);
+    g_in_malloc = 0;
+    safepoint();
+}
+
 /**
  * Got a signal from a thread wanting to do cleanup.
  */
 static void signal_handler (int sig)
 {
+    int saved_errno = errno;
     assert(SIGFORKSCAN == sig);
+    forkscan_relay_signal();
     if (g_in_malloc) {
         g_waiting_to_fork = 1;
-        return;
+    } else {
+        forkscan_acknowledge_signal();
     }
-    forkscan_acknowledge_signal();
+    errno = saved_errno;
 }
 
 /**
@@ -169,26 +240,148 @@ __attribute__((visibility("default")))
 void *forkscan_malloc (size_t size)
 {
     void *p;
+    thread_data_t *td = forkscan_thread_get_td();
+
+    // Blocks this thread reclaimed are reused without a trip through the
+    // allocator.
+    if (td && g_forkscan_magazine_size > 0
+        && NULL != (p = forkscan_util_magazine_get(td, size))) {
+        safepoint();
+        return p;
+    }
+
     g_in_malloc = 1;
-    p = MALLOC(size);
+    if (size >= LARGE_OBJECT_THRESHOLD) {
+        if (NULL == (p = forkscan_large_alloc(size))) p = MALLOC(size);
+    } else if (NULL == (p = forkscan_slab_alloc(size))) p = MALLOC(size);
     g_in_malloc = 0;
 
-    if (g_waiting_to_fork) {
-        // Sadly, TC-Malloc has a deadlock bug when interacting with fork().
-        // We need to make sure it isn't holding the global lock when we
-        // initiate cleanup.
-        g_waiting_to_fork = 0;
-        forkscan_acknowledge_signal();
-    }
+    // Sadly, TC-Malloc has a deadlock bug when interacting with fork().
+    // We need to make sure it isn't holding the global lock when we
+    // initiate cleanup.
+    safepoint();
     return p;
 }
 
 /**
- * Retire a pointer allocated by Forkscan so that it will be free'd for reuse
- * when no remaining references to it exist.
+ * Find a home for ptr when this thread's local queue of pointers is full.
+ * If nobody else is reclaiming, this thread does it, which empties the
+ * queue.  Otherwise ptr is spilled to the GC thread's overflow list.  Only
+ * past the spill limit does the thread wait, and then it sleeps until an
+ * iteration completes rather than spinning.
+ */
+static void retire_overflow (thread_data_t *td, size_t ptr)
+{
+    size_t start = 0;
+
+    while (1) {
+        int iteration = forkscan_iteration_count();
+
+        if (forkscan_thread_cleanup_try_acquire()) {
+            become_reclaimer(); // this releases the cleanup lock.
+        }
+        if (!forkscan_queue_is_full(&td->ptr_list)) {
+            forkscan_queue_push(&td->ptr_list, ptr);
+            break;
+        }
+        if (forkscan_buffer_spill(&td->spill, ptr)) break;
+
+        // Too much has been spilled.  Help out, then wait.
+        if (0 == start) start = forkscan_rdtsc();
+        g_in_malloc = 1;
+        forkscan_util_free_ptrs(td, g_forkscan_free_latency_ns);
+        g_in_malloc = 0;
+        safepoint();
+        forkscan_wait_for_iteration(iteration);
+    }
+
+    if (start) td->wait_time_ms += forkscan_rdtsc() - start;
+}
+
+/**
+ * A pointer was just added to this thread's queue.  Hand off any spill
+ * chunk left over from when it was full, and start reclamation if it is
+ * full now.
+ */
+static void retire_added (thread_data_t *td)
+{
+    if (forkscan_queue_is_full(&td->ptr_list)) {
+        if (forkscan_thread_cleanup_try_acquire()) {
+            become_reclaimer(); // this releases the cleanup lock.
+        }
+    } else if (td->spill) {
+        forkscan_buffer_spill_flush(&td->spill);
+    }
+}
+
+/**
+ * Act on what the memory target asks of a thread that just retired: start
+ * an iteration early or, past the hard cap, help free and wait for the
+ * garbage to shrink.  Garbage that is still referenced won't shrink, so
+ * the wait ends after a couple of iterations regardless.
+ */
+static void memory_paced (thread_data_t *td, int memory)
+{
+    int iteration;
+    size_t start;
+
+    if (MEMORY_OK == memory) return;
+    if (forkscan_thread_cleanup_try_acquire()) {
+        become_reclaimer(); // this releases the cleanup lock.
+    }
+    if (MEMORY_THROTTLE != memory) return;
+
+    iteration = forkscan_iteration_count();
+    start = forkscan_rdtsc();
+    while (forkscan_util_over_memory_limit()
+           && forkscan_iteration_count() - iteration < 2) {
+        g_in_malloc = 1;
+        forkscan_util_free_ptrs(td, g_forkscan_free_latency_ns);
+        g_in_malloc = 0;
+        safepoint();
+        if (!forkscan_util_helps_free(td)
+            || 0 == forkscan_util_free_budget(1)) {
+            forkscan_wait_for_iteration(forkscan_iteration_count());
+        }
+    }
+    td->wait_time_ms += forkscan_rdtsc() - start;
+}
+
+/**
+ * Allocate memory, as with forkscan_malloc(), for an object that will never
+ * hold pointers: strings, blobs, numeric arrays.  It comes from an arena
+ * that isn't scanned for references, and reachable blocks from it aren't
+ * traced.  Storing a pointer in it won't keep the target alive.
  */
 __attribute__((visibility("default")))
-void forkscan_retire (void *ptr)
+void *forkscan_malloc_nopointers (size_t size)
+{
+    void *p;
+    g_in_malloc = 1;
+    p = forkscan_nopointers_alloc(size);
+    g_in_malloc = 0;
+
+    safepoint();
+    // Fall back on memory that gets scanned, which is safe, just slower.
+    return p ? p : forkscan_malloc(size);
+}
+
+/**
+ * Note the time of a retire if it's the oldest one waiting, for the GC
+ * thread's latency trigger.
+ */
+static inline void stamp_retire ()
+{
+    if (g_forkscan_max_latency_ms && 0 == g_forkscan_oldest_retire_ns) {
+        g_forkscan_oldest_retire_ns = forkscan_util_ns();
+    }
+}
+
+/**
+ * Retire ptr.  "val" is what goes on the pointer list: ptr, possibly with
+ * its size tucked into the high bits.
+ */
+static void retire (void *ptr, size_t val)
 {
     if (NULL == ptr) {
         forkscan_diagnostic("Tried to collect NULL.\n");
@@ -196,30 +389,157 @@ void forkscan_retire (void *ptr)
     }
 
     thread_data_t *td = forkscan_thread_get_td();
-    // Free a couple pointers, if we have them.
+    // Free this retire's share of the backlog.
     g_in_malloc = 1;
-    forkscan_util_free_ptrs(td);
+    forkscan_util_free_ptrs(td, forkscan_util_free_budget(1));
+    long large = forkscan_large_retire(ptr);
     g_in_malloc = 0;
-    if (g_waiting_to_fork) {
-        g_waiting_to_fork = 0;
-        forkscan_acknowledge_signal();
+    safepoint();
+    if (large >= 0) {
+        // Big blocks bypass the pointer list, but enough of them can start
+        // an iteration without waiting for the list to fill.
+        // If somebody else is already reclaiming, the iteration they start
+        // will pick up the large objects.
+        if (forkscan_large_wants_collection()
+            && forkscan_thread_cleanup_try_acquire()) {
+            become_reclaimer(); // this releases the cleanup lock.
+        }
+        memory_paced(td, forkscan_util_account_retire(td, large));
+        return;
     }
-    forkscan_queue_push(&td->ptr_list, (size_t)ptr); // Add the pointer.
     if (forkscan_queue_is_full(&td->ptr_list)) {
-        size_t start, end;
-        size_t n_loops = 0;
-
-        start = forkscan_rdtsc();
-        do {
-            // While this thread's local queue of pointers is full, try to
-            // initiate reclamation.
-
-            forkscan_thread_cleanup_try_acquire()
-                ? become_reclaimer() // this releases the cleanup lock.
-                : yield(n_loops);
-        } while (forkscan_queue_is_full(&td->ptr_list));
-        end = forkscan_rdtsc();
-        td->wait_time_ms += end - start;
+        retire_overflow(td, val);
+    } else {
+        forkscan_queue_push(&td->ptr_list, val); // Add the pointer.
+    }
+    stamp_retire();
+    retire_added(td);
+    if (g_forkscan_memory_target) {
+        memory_paced(td, forkscan_util_account_retire(
+                         td, forkscan_util_retired_size(val)));
+    }
+}
+
+/**
+ * Retire a pointer allocated by Forkscan so that it will be free'd for reuse
+ * when no remaining references to it exist.
+ */
+__attribute__((visibility("default")))
+void forkscan_retire (void *ptr)
+{
+    retire(ptr, (size_t)ptr);
+}
+
+/**
+ * Retire a pointer, as with forkscan_retire(), whose size is known.  This
+ * spares Forkscan from asking the allocator.
+ */
+__attribute__((visibility("default")))
+void forkscan_retire_sized (void *ptr, size_t size)
+{
+    retire(ptr, SIZED_PTR((size_t)ptr, size));
+}
+
+/**
+ * Register an object layout for use with forkscan_retire_typed().  Bit i
+ * of pointer_bitmap is set if the i'th word of the object may hold a
+ * pointer; words past the 64th are treated as though they might.
+ * @return The type ID, or -1 if no more types can be registered.
+ */
+__attribute__((visibility("default")))
+int forkscan_register_type (size_t size, unsigned long long pointer_bitmap)
+{
+    int ret = forkscan_types_register(size, pointer_bitmap);
+    if (ret < 0) forkscan_diagnostic("Too many types registered.\n");
+    return ret;
+}
+
+/**
+ * Retire a pointer, as with forkscan_retire(), to an object of a type
+ * registered with forkscan_register_type().  Only its pointer words are
+ * traced, and objects without any aren't traced at all.
+ */
+__attribute__((visibility("default")))
+void forkscan_retire_typed (void *ptr, int type_id)
+{
+    if (type_id <= 0 || type_id > forkscan_types_count()) {
+        forkscan_diagnostic("Bad type ID %d.\n", type_id);
+        retire(ptr, (size_t)ptr);
+        return;
+    }
+    retire(ptr, TYPED_PTR((size_t)ptr, (size_t)type_id));
+}
+
+/**
+ * Retire n pointers allocated by Forkscan.  Equivalent to calling
+ * forkscan_retire() on each, but the per-call overhead (free'ing, signal
+ * handling, checking for a full queue) is paid once per batch.
+ */
+__attribute__((visibility("default")))
+void forkscan_retire_batch (void **ptrs, size_t n)
+{
+    thread_data_t *td = forkscan_thread_get_td();
+    int large = 0, paced = 0 != g_forkscan_memory_target;
+    size_t i = 0, j, bytes = 0;
+
+    // Free this batch's share of the backlog.
+    g_in_malloc = 1;
+    forkscan_util_free_ptrs(td, forkscan_util_free_budget(n));
+    g_in_malloc = 0;
+    safepoint();
+
+    while (i < n) {
+        // Push the longest run of ordinary pointers that fits in the queue.
+        size_t room = forkscan_queue_available(&td->ptr_list);
+        size_t run = 0;
+        while (i + run < n && run < room
+               && NULL != ptrs[i + run]
+               && !forkscan_large_maybe(ptrs[i + run])) {
+            ++run;
+        }
+        if (run > 0) {
+            forkscan_queue_push_bulk(&td->ptr_list, (size_t*)&ptrs[i], run);
+            for (j = i; paced && j < i + run; ++j) {
+                bytes += forkscan_util_retired_size((size_t)ptrs[j]);
+            }
+            i += run;
+            continue;
+        }
+
+        // NULL, (possibly) a large object, or the queue is full.
+        void *ptr = ptrs[i++];
+        if (NULL == ptr) {
+            forkscan_diagnostic("Tried to collect NULL.\n");
+            continue;
+        }
+        if (forkscan_large_maybe(ptr)) {
+            long length;
+            g_in_malloc = 1;
+            length = forkscan_large_retire(ptr);
+            g_in_malloc = 0;
+            safepoint();
+            if (length >= 0) {
+                large = 1;
+                bytes += length;
+                continue;
+            }
+        }
+        if (forkscan_queue_is_full(&td->ptr_list)) {
+            retire_overflow(td, (size_t)ptr);
+        } else {
+            forkscan_queue_push(&td->ptr_list, (size_t)ptr);
+        }
+        if (paced) bytes += forkscan_util_retired_size((size_t)ptr);
+    }
+    stamp_retire();
+    retire_added(td);
+
+    // The whole batch is counted against the memory target at once.
+    if (paced) memory_paced(td, forkscan_util_account_retire(td, bytes));
+
+    if (large && forkscan_large_wants_collection()
+        && forkscan_thread_cleanup_try_acquire()) {
+        become_reclaimer(); // this releases the cleanup lock.
     }
 }
 
@@ -232,13 +552,62 @@ __attribute__((visibility("default")))
 void forkscan_free (void *ptr)
 {
     g_in_malloc = 1;
-    FREE(ptr);
+    if (forkscan_slab_owns((size_t)ptr)) forkscan_slab_free(ptr);
+    else if (forkscan_nopointers_owns((size_t)ptr)) {
+        forkscan_nopointers_free(ptr);
+    } else if (!forkscan_large_free(ptr)) FREE(ptr);
     g_in_malloc = 0;
 
-    if (g_waiting_to_fork) {
-        g_waiting_to_fork = 0;
-        forkscan_acknowledge_signal();
-    }
+    safepoint();
+}
+
+/**
+ * help = 1 (default) or 0: whether the calling thread frees retired memory
+ * for everybody as it retires.  Latency-sensitive threads can opt out when
+ * freer threads (FORKSCAN_FREER_THREADS) are doing the work.
+ */
+__attribute__((visibility("default")))
+void forkscan_set_helping (int help)
+{
+    thread_data_t *td = forkscan_thread_get_td();
+    if (td) td->helps_free = help || 0 == g_forkscan_freer_threads;
+}
+
+/**
+ * A safepoint for compute loops that go a long time without allocating
+ * or retiring.  With FORKSCAN_SAFEPOINTS set, snapshots wait for every
+ * running thread to reach one.  Otherwise this does nothing.  A thread
+ * that doesn't get to one within about 10ms (say, it's waiting on a lock
+ * held by a thread that has stopped) is signalled after all, so wrap
+ * long waits in forkscan_enter_blocking() and forkscan_exit_blocking().
+ */
+__attribute__((visibility("default")))
+void forkscan_safepoint ()
+{
+    safepoint();
+}
+
+/**
+ * Declare that the calling thread is about to block (in read(), poll(),
+ * pthread_cond_wait(), ...).  Until forkscan_exit_blocking(), it is not
+ * interrupted for snapshots and they don't wait on it.  In between, the
+ * thread must not allocate, retire, or touch the Forkscan heap.  Calls
+ * may nest.
+ */
+__attribute__((visibility("default")))
+void forkscan_enter_blocking ()
+{
+    forkscan_thread_enter_blocking();
+}
+
+/**
+ * End a blocking region begun with forkscan_enter_blocking().  If a
+ * snapshot is being taken, this waits for it to finish.
+ */
+__attribute__((visibility("default")))
+void forkscan_exit_blocking ()
+{
+    forkscan_thread_exit_blocking();
 }
 
 /**
@@ -273,6 +642,41 @@ void forkscan_set_auto_run (int auto_run)
     g_config.auto_run = auto_run;
 }
 
+/**
+ * Keep outstanding garbage near "bytes": an iteration starts once that
+ * much has been retired, and past twice that, retiring threads wait for
+ * garbage to be free'd.  0 (the default) turns this off.
+ */
+__attribute__((visibility("default")))
+void forkscan_set_memory_target (size_t bytes)
+{
+    forkscan_util_set_memory_target(bytes);
+}
+
+/**
+ * Change a setting in the running process.  "name" is the environment
+ * variable's (FORKSCAN_PERIOD_MS, or just period_ms), and "value" is in
+ * the same units.  Scanning, freeing, throttling, scheduling and tuning
+ * settings can be changed; out-of-range values are clamped.  Changes take
+ * effect by the next iteration.
+ * @return 0, or -1 if there is no such setting.
+ */
+__attribute__((visibility("default")))
+int forkscan_set_param (const char *name, long long value)
+{
+    return forkscan_params_set(name, value);
+}
+
+/**
+ * Store a setting's current value, as for forkscan_set_param(), in *value.
+ * @return 0, or -1 if there is no such setting.
+ */
+__attribute__((visibility("default")))
+int forkscan_get_param (const char *name, long long *value)
+{
+    return forkscan_params_get(name, value);
+}
+
 /**
  * Allocate a buffer of "size" bytes and return a pointer to it.  This memory
  * will be tracked by the garbage collector, so free() should never be called
@@ -36,12 +36,49 @@ extern "C" {
  */
 void *forkscan_malloc (size_t size);
 
+/**
+ * Allocate memory, as with forkscan_malloc(), for an object that will never
+ * hold pointers: strings, blobs, numeric arrays.  It comes from an arena
+ * that isn't scanned for references, and reachable blocks from it aren't
+ * traced.  Storing a pointer in it won't keep the target alive.
+ */
+void *forkscan_malloc_nopointers (size_t size);
+
 /**
  * Retire a pointer allocated by Forkscan so that it will be free'd for reuse
  * when no remaining references to it exist.
  */
 void forkscan_retire (void *ptr);
 
+/**
+ * Retire a pointer, as with forkscan_retire(), whose size is known.  This
+ * spares Forkscan from asking the allocator.  "size" may be smaller than
+ * the block the allocator handed out, but no smaller than the object.
+ */
+void forkscan_retire_sized (void *ptr, size_t size);
+
+/**
+ * Register an object layout for use with forkscan_retire_typed().  Bit i
+ * of pointer_bitmap is set if the i'th word of the object may hold a
+ * pointer; words past the 64th are treated as though they might.
+ * @return The type ID, or -1 if no more types can be registered.
+ */
+int forkscan_register_type (size_t size, unsigned long long pointer_bitmap);
+
+/**
+ * Retire a pointer, as with forkscan_retire(), to an object of a type
+ * registered with forkscan_register_type().  Only its pointer words are
+ * traced, and objects without any aren't traced at all.
+ */
+void forkscan_retire_typed (void *ptr, int type_id);
+
+/**
+ * Retire n pointers allocated by Forkscan.  Equivalent to calling
+ * forkscan_retire() on each, but cheaper for structures that unlink several
+ * nodes at once.
+ */
+void forkscan_retire_batch (void **ptrs, size_t n);
+
 /**
  * Free a pointer allocated by Forkscan.  The memory may be immediately reused,
  * so if there is any possibility another thread may know about this memory
@@ -49,6 +86,38 @@ void forkscan_retire (void *ptr);
  */
 void forkscan_free (void *ptr);
 
+/**
+ * help = 1 (default) or 0: whether the calling thread frees retired memory
+ * for everybody as it retires.  Latency-sensitive threads can opt out when
+ * freer threads (FORKSCAN_FREER_THREADS) are doing the work.
+ */
+void forkscan_set_helping (int help);
+
+/**
+ * A safepoint for compute loops that go a long time without allocating
+ * or retiring.  With FORKSCAN_SAFEPOINTS set, snapshots wait for every
+ * running thread to reach one.  Otherwise this does nothing.  A thread
+ * that doesn't get to one within about 10ms (say, it's waiting on a lock
+ * held by a thread that has stopped) is signalled after all, so wrap
+ * long waits in forkscan_enter_blocking() and forkscan_exit_blocking().
+ */
+void forkscan_safepoint ();
+
+/**
+ * Declare that the calling thread is about to block (in read(), poll(),
+ * pthread_cond_wait(), ...).  Until forkscan_exit_blocking(), it is not
+ * interrupted for snapshots and they don't wait on it.  In between, the
+ * thread must not allocate, retire, or touch the Forkscan heap.  Calls
+ * may nest.
+ */
+void forkscan_enter_blocking ();
+
+/**
+ * End a blocking region begun with forkscan_enter_blocking().  If a
+ * snapshot is being taken, this waits for it to finish.
+ */
+void forkscan_exit_blocking ();
+
 /**
  * Perform an iteration of reclamation.  This is intended for users who have
  * disabled automatic iterations or who otherwise want to override it and
@@ -67,6 +136,29 @@ int forkscan_force_reclaim ();
  */
 void forkscan_set_auto_run (int auto_run);
 
+/**
+ * Keep outstanding garbage near "bytes": an iteration starts once that
+ * much has been retired, and past twice that, retiring threads wait for
+ * garbage to be free'd.  0 (the default) turns this off.
+ */
+void forkscan_set_memory_target (size_t bytes);
+
+/**
+ * Change a setting in the running process.  "name" is the environment
+ * variable's (FORKSCAN_PERIOD_MS, or just period_ms), and "value" is in
+ * the same units.  Scanning, freeing, throttling, scheduling and tuning
+ * settings can be changed; out-of-range values are clamped.  Changes take
+ * effect by the next iteration.
+ * @return 0, or -1 if there is no such setting.
+ */
+int forkscan_set_param (const char *name, long long value);
+
+/**
+ * Store a setting's current value, as for forkscan_set_param(), in *value.
+ * @return 0, or -1 if there is no such setting.
+ */
+int forkscan_get_param (const char *name, long long *value);
+
 /**
  * Allocate a buffer of "size" bytes and return a pointer to it.  This memory
  * will be tracked by the garbage collector, so free() should never be called
@@ -81,6 +173,25 @@ extern void forkscan_set_allocator (void *(*alloc) (size_t),
                                     void (*dealloc) (void *),
                                     size_t (*usable_size) (void *));
 
+/**
+ * Set the allocator, as with forkscan_set_allocator(), along with optional
+ * faster ways to free: free_sized (like sdallocx() or free_sized()) gets
+ * the block's size, and free_batch gets a run of blocks in address order.
+ * Either may be NULL.
+ */
+extern void forkscan_set_allocator_ext (void *(*alloc) (size_t),
+                                        void (*dealloc) (void *),
+                                        size_t (*usable_size) (void *),
+                                        void (*free_sized) (void *, size_t),
+                                        void (*free_batch) (void **, size_t));
+
+/**
+ * Copy the stop-the-world pause histogram into counts: counts[0] is pauses
+ * under 1us and counts[i] those under 2^i us (but at least 2^(i-1)).
+ * Returns the number of buckets Forkscan keeps.
+ */
+extern int forkscan_pause_histogram (unsigned long long *counts, int n);
+
 
 /**
  * Robust sleep with whole-second intervals.  This won't exit when there's
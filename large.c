@@ -0,0 +1,336 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "alloc.h"
+#include <assert.h>
+#include "large.h"
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "util.h"
+
+/****************************************************************************/
+/*                         Defines, typedefs, etc.                          */
+/****************************************************************************/
+
+#define REGISTRY_INIT_CAPACITY 128
+
+#define PAGE_ROUND(sz) (((sz) + PAGESIZE - 1) & ~(PAGESIZE - 1))
+
+typedef struct large_entry_t large_entry_t;
+
+struct large_entry_t
+{
+    size_t addr;
+    size_t length;
+    size_t retired;
+};
+
+/****************************************************************************/
+/*                                 Globals                                  */
+/****************************************************************************/
+
+// Every large object, sorted by address.  This lives in Forkscan's own
+// memory so it never looks like a root.
+static large_entry_t *g_registry;
+static int g_n_registry;
+static int g_registry_capacity;
+static pthread_mutex_t g_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Where large objects start, for a quick, lock-free "not large" answer.
+// The bits change with the registry lock held.  Untouched pages of the
+// map cost nothing, and the allocator's arenas only ever read theirs.
+volatile size_t *volatile g_large_map;
+
+// Candidates for this iteration.  Shared, so the child's marks are seen.
+static large_obj_t *g_candidates;
+static int g_n_candidates;
+static int g_candidates_capacity;
+
+static volatile size_t g_pending_bytes;
+static volatile int g_collection_requested;
+
+/****************************************************************************/
+/*                             Registry helpers                             */
+/****************************************************************************/
+
+/**
+ * Return the index of the registry entry at or before addr.  -1 if none.
+ * Hold the registry lock.
+ */
+static int registry_find (size_t addr)
+{
+    int min = 0, max = g_n_registry - 1;
+    while (min <= max) {
+        int mid = (min + max) / 2;
+        if (g_registry[mid].addr == addr) return mid;
+        if (g_registry[mid].addr < addr) min = mid + 1;
+        else max = mid - 1;
+    }
+    return max;
+}
+
+/**
+ * Return the registry index of the object starting at ptr, or -1 if ptr
+ * isn't a large object.  Hold the registry lock.
+ */
+static int registry_lookup (void *ptr)
+{
+    int idx = registry_find((size_t)ptr);
+    if (idx < 0 || g_registry[idx].addr != (size_t)ptr) return -1;
+    return idx;
+}
+
+/**
+ * Set or clear the map bit for the granule where addr starts.  Hold the
+ * registry lock.
+ */
+static void map_mark (size_t addr, int set)
+{
+    size_t granule = addr >> LARGE_GRANULE_SHIFT;
+    size_t bit = (size_t)1 << (granule % LARGE_MAP_WORD_BITS);
+    volatile size_t *word;
+
+    if (NULL == g_large_map) {
+        g_large_map = (volatile size_t*)
+            forkscan_alloc_mmap((size_t)1 << (LARGE_ADDR_BITS
+                                              - LARGE_GRANULE_SHIFT - 3),
+                                "large map");
+    }
+    word = &g_large_map[granule / LARGE_MAP_WORD_BITS];
+    if (set) __sync_fetch_and_or(word, bit);
+    else __sync_fetch_and_and(word, ~bit);
+}
+
+static void registry_insert (size_t addr, size_t length)
+{
+    if (g_n_registry == g_registry_capacity) {
+        size_t sz = PAGE_ROUND((g_registry_capacity == 0
+                                ? REGISTRY_INIT_CAPACITY
+                                : g_registry_capacity * 2)
+                               * sizeof(large_entry_t));
+        int capacity = sz / sizeof(large_entry_t);
+        large_entry_t *registry = (large_entry_t*)
+            forkscan_alloc_mmap(sz, "large registry");
+        if (g_registry) {
+            memcpy(registry, g_registry,
+                   g_n_registry * sizeof(large_entry_t));
+            forkscan_alloc_munmap(g_registry);
+        }
+        g_registry = registry;
+        g_registry_capacity = capacity;
+    }
+
+    int idx = registry_find(addr) + 1;
+    memmove(&g_registry[idx + 1], &g_registry[idx],
+            (g_n_registry - idx) * sizeof(large_entry_t));
+    g_registry[idx].addr = addr;
+    g_registry[idx].length = length;
+    g_registry[idx].retired = 0;
+    ++g_n_registry;
+    map_mark(addr, 1);
+}
+
+static void registry_remove (int idx)
+{
+    assert(idx >= 0 && idx < g_n_registry);
+    map_mark(g_registry[idx].addr, 0);
+    --g_n_registry;
+    memmove(&g_registry[idx], &g_registry[idx + 1],
+            (g_n_registry - idx) * sizeof(large_entry_t));
+}
+
+/****************************************************************************/
+/*                           Application threads.                           */
+/****************************************************************************/
+
+/**
+ * Allocate a block in the large-object space.
+ * @return The block, or NULL if there isn't room for it there.
+ */
+void *forkscan_large_alloc (size_t size)
+{
+    size_t length = (size + PAGESIZE - 1) & ~(PAGESIZE - 1);
+
+    // Not forkscan_alloc_mmap(): that memory is never scanned, and live
+    // large objects may well hold references.
+    void *ptr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (MAP_FAILED == ptr) return NULL;
+    if ((size_t)ptr >> LARGE_ADDR_BITS) {
+        // Beyond the map.  The allocator can have it.
+        munmap(ptr, length);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_registry_lock);
+    registry_insert((size_t)ptr, length);
+    pthread_mutex_unlock(&g_registry_lock);
+
+    return ptr;
+}
+
+/**
+ * Release a block immediately if it is in the large-object space.
+ * @return 1 if it was a large object, zero otherwise.
+ */
+int forkscan_large_free (void *ptr)
+{
+    size_t length;
+    int idx, retired;
+
+    if (!forkscan_large_maybe(ptr)) return 0;
+
+    pthread_mutex_lock(&g_registry_lock);
+    idx = registry_lookup(ptr);
+    if (idx >= 0) {
+        length = g_registry[idx].length;
+        retired = g_registry[idx].retired;
+        registry_remove(idx);
+    }
+    pthread_mutex_unlock(&g_registry_lock);
+
+    if (idx < 0) return 0;
+    munmap(ptr, length);
+    if (retired) forkscan_util_account_free(length);
+    return 1;
+}
+
+/**
+ * Retire a block if it is in the large-object space.
+ * @return The length of the block if it was a large object (zero if it had
+ * already been retired), or -1 otherwise.
+ */
+long forkscan_large_retire (void *ptr)
+{
+    size_t length = 0;
+    int idx;
+
+    if (!forkscan_large_maybe(ptr)) return -1;
+
+    pthread_mutex_lock(&g_registry_lock);
+    idx = registry_lookup(ptr);
+    if (idx >= 0 && !g_registry[idx].retired) {
+        g_registry[idx].retired = 1;
+        length = g_registry[idx].length;
+    }
+    pthread_mutex_unlock(&g_registry_lock);
+
+    if (idx < 0) return -1;
+    __sync_fetch_and_add(&g_pending_bytes, length);
+    return (long)length;
+}
+
+/**
+ * Return 1 (to exactly one caller) if enough large-object bytes have been
+ * retired that an iteration should start early.
+ */
+int forkscan_large_wants_collection ()
+{
+    if (g_pending_bytes < LARGE_OBJECT_TRIGGER) return 0;
+    return BCAS(&g_collection_requested, 0, 1);
+}
+
+/****************************************************************************/
+/*                         GC thread and the child.                         */
+/****************************************************************************/
+
+/**
+ * Gather the retired large objects into the candidate set for the next
+ * iteration.  Must be called before the fork.
+ * @return The number of candidates.
+ */
+int forkscan_large_snapshot ()
+{
+    int i;
+
+    pthread_mutex_lock(&g_registry_lock);
+    if (g_n_registry > g_candidates_capacity) {
+        size_t sz = PAGE_ROUND(g_registry_capacity * sizeof(large_obj_t));
+        if (g_candidates) forkscan_alloc_munmap(g_candidates);
+        g_candidates_capacity = sz / sizeof(large_obj_t);
+        g_candidates = (large_obj_t*)
+            forkscan_alloc_mmap_shared(sz, "large candidates");
+    }
+    g_n_candidates = 0;
+    for (i = 0; i < g_n_registry; ++i) {
+        if (!g_registry[i].retired) continue;
+        large_obj_t *lo = &g_candidates[g_n_candidates++];
+        lo->low = g_registry[i].addr;
+        lo->high = g_registry[i].addr + g_registry[i].length;
+        lo->marked = 0;
+    }
+    g_pending_bytes = 0;
+    g_collection_requested = 0;
+    pthread_mutex_unlock(&g_registry_lock);
+
+    return g_n_candidates;
+}
+
+/**
+ * Release the candidates the child didn't mark.
+ */
+void forkscan_large_sweep ()
+{
+    int i;
+
+    for (i = 0; i < g_n_candidates; ++i) {
+        large_obj_t *lo = &g_candidates[i];
+        if (lo->marked) continue; // Still referenced.  Try again next time.
+
+        pthread_mutex_lock(&g_registry_lock);
+        int idx = registry_lookup((void*)lo->low);
+        if (idx >= 0) registry_remove(idx);
+        pthread_mutex_unlock(&g_registry_lock);
+
+        // If it's gone, the user free'd a retired block.  Don't do it twice.
+        if (idx >= 0) {
+            munmap((void*)lo->low, lo->high - lo->low);
+            forkscan_util_account_free(lo->high - lo->low);
+        }
+    }
+    g_n_candidates = 0;
+}
+
+/**
+ * Return the candidate set, sorted by address, and its size in *n.
+ */
+large_obj_t *forkscan_large_candidates (int *n)
+{
+    *n = g_n_candidates;
+    return g_candidates;
+}
+
+/**
+ * Return the candidate that contains addr, or NULL if there is none.
+ */
+large_obj_t *forkscan_large_find (size_t addr)
+{
+    int min = 0, max = g_n_candidates - 1;
+    while (min <= max) {
+        int mid = (min + max) / 2;
+        if (g_candidates[mid].low <= addr) min = mid + 1;
+        else max = mid - 1;
+    }
+    if (max < 0 || addr >= g_candidates[max].high) return NULL;
+    return &g_candidates[max];
+}
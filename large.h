@@ -0,0 +1,132 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Module Description:
+   Large-object space.  Big blocks are mmap()'d individually rather than
+   coming from the allocator, and retiring them keeps them out of the
+   per-thread pointer lists.  Each iteration, the retired ones are handed to
+   the child as a small sorted set of page ranges, and the ones the child
+   doesn't find are munmap()'d outright -- no memset(), no free().
+ */
+
+#ifndef _LARGE_H_
+#define _LARGE_H_
+
+#include <stddef.h>
+
+// Blocks at least this big go in the large-object space.
+#define LARGE_OBJECT_THRESHOLD (256 * 1024)
+
+// No two large objects start in the same 2^LARGE_GRANULE_SHIFT bytes, so
+// a bit per granule says where they might be.  The map covers a 47-bit
+// address space.
+#define LARGE_GRANULE_SHIFT 18
+#define LARGE_ADDR_BITS 47
+#define LARGE_MAP_WORD_BITS (sizeof(size_t) * 8)
+
+// Retired large-object bytes that will start an iteration early.
+#define LARGE_OBJECT_TRIGGER (64 * 1024 * 1024)
+
+typedef struct large_obj_t large_obj_t;
+
+/** A retired large object that is a candidate for release this iteration.
+ */
+struct large_obj_t {
+    size_t low;
+    size_t high;
+    volatile size_t marked;
+};
+
+// A bit for each granule where a large object starts.  NULL until the
+// first large allocation.
+extern volatile size_t *volatile g_large_map;
+
+/****************************************************************************/
+/*                           Application threads.                           */
+/****************************************************************************/
+
+/**
+ * Return nonzero if ptr might be the start of a block in the large-object
+ * space.  A lock-free bitmap check; zero means it certainly isn't.
+ */
+static inline int forkscan_large_maybe (void *ptr)
+{
+    volatile size_t *map = g_large_map;
+    size_t granule = (size_t)ptr >> LARGE_GRANULE_SHIFT;
+
+    if (NULL == map || (size_t)ptr >> LARGE_ADDR_BITS) return 0;
+    return (map[granule / LARGE_MAP_WORD_BITS]
+            >> (granule % LARGE_MAP_WORD_BITS)) & 1;
+}
+
+/**
+ * Allocate a block in the large-object space.
+ * @return The block, or NULL if there isn't room for it there.
+ */
+void *forkscan_large_alloc (size_t size);
+
+/**
+ * Release a block immediately if it is in the large-object space.
+ * @return 1 if it was a large object, zero otherwise.
+ */
+int forkscan_large_free (void *ptr);
+
+/**
+ * Retire a block if it is in the large-object space.
+ * @return The length of the block if it was a large object (zero if it had
+ * already been retired), or -1 otherwise.
+ */
+long forkscan_large_retire (void *ptr);
+
+/**
+ * Return 1 (to exactly one caller) if enough large-object bytes have been
+ * retired that an iteration should start early.
+ */
+int forkscan_large_wants_collection ();
+
+/****************************************************************************/
+/*                         GC thread and the child.                         */
+/****************************************************************************/
+
+/**
+ * Gather the retired large objects into the candidate set for the next
+ * iteration.  Must be called before the fork.
+ * @return The number of candidates.
+ */
+int forkscan_large_snapshot ();
+
+/**
+ * Release the candidates the child didn't mark.
+ */
+void forkscan_large_sweep ();
+
+/**
+ * Return the candidate set, sorted by address, and its size in *n.
+ */
+large_obj_t *forkscan_large_candidates (int *n);
+
+/**
+ * Return the candidate that contains addr, or NULL if there is none.
+ */
+large_obj_t *forkscan_large_find (size_t addr);
+
+#endif // !defined _LARGE_H_
@@ -0,0 +1,185 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "alloc.h"
+#include <assert.h>
+#include "nopointers.h"
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "util.h"
+
+/****************************************************************************/
+/*                         Defines, typedefs, etc.                          */
+/****************************************************************************/
+
+#define N_CLASSES (NOPTR_MAX_SHIFT - NOPTR_MIN_SHIFT + 1)
+#define NOPTR_UNIT ((size_t)1 << NOPTR_UNIT_SHIFT)
+
+// How much of the reserved arena is made accessible at a time, at least.
+#define NOPTR_GROW_SIZE ((size_t)4 * 1024 * 1024)
+
+typedef struct noptr_class_t noptr_class_t;
+
+struct noptr_class_t
+{
+    pthread_mutex_t lock;
+    free_t *free_list;
+    size_t bump, bump_end; // Unused part of the class's last chunk.
+};
+
+/****************************************************************************/
+/*                                 Globals                                  */
+/****************************************************************************/
+
+size_t g_noptr_base;
+size_t g_noptr_span;
+unsigned char *g_noptr_class;
+
+static noptr_class_t g_classes[N_CLASSES];
+
+static pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t g_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_arena_top;       // Offset of the next new chunk.
+static size_t g_arena_committed; // Offset of the end of accessible memory.
+
+/****************************************************************************/
+/*                                 Helpers                                  */
+/****************************************************************************/
+
+static void noptr_init ()
+{
+    int c;
+
+    void *p = forkscan_alloc_reserve(NOPTR_ARENA_SIZE, "nopointers");
+    if (NULL == p) {
+        forkscan_diagnostic("unable to reserve the pointer-free arena.\n");
+        return;
+    }
+    g_noptr_class = (unsigned char*)
+        forkscan_alloc_mmap(NOPTR_ARENA_SIZE >> NOPTR_UNIT_SHIFT,
+                            "nopointers classes");
+    for (c = 0; c < N_CLASSES; ++c) {
+        pthread_mutex_init(&g_classes[c].lock, NULL);
+    }
+    g_noptr_base = (size_t)p;
+    __sync_synchronize();
+    g_noptr_span = NOPTR_ARENA_SIZE;
+}
+
+/**
+ * Carve a chunk of "size" bytes (a multiple of the unit) for class c out of
+ * the arena.  Return 0 if the arena is exhausted.
+ */
+static size_t new_chunk (size_t size, int c)
+{
+    size_t chunk = 0;
+
+    pthread_mutex_lock(&g_arena_lock);
+    if (g_arena_top + size > g_arena_committed) {
+        size_t grow = MAX_OF(size, NOPTR_GROW_SIZE);
+        if (g_arena_committed + grow <= NOPTR_ARENA_SIZE
+            && 0 == mprotect((void*)(g_noptr_base + g_arena_committed),
+                             grow, PROT_READ | PROT_WRITE)) {
+            g_arena_committed += grow;
+        }
+    }
+    if (g_arena_top + size <= g_arena_committed) {
+        chunk = g_noptr_base + g_arena_top;
+        g_arena_top += size;
+    }
+    pthread_mutex_unlock(&g_arena_lock);
+
+    if (chunk) {
+        size_t unit = (chunk - g_noptr_base) >> NOPTR_UNIT_SHIFT;
+        size_t n_units = size >> NOPTR_UNIT_SHIFT;
+        memset(&g_noptr_class[unit], c, n_units);
+    }
+    return chunk;
+}
+
+/****************************************************************************/
+/*                                Interface                                 */
+/****************************************************************************/
+
+/**
+ * Allocate from the pointer-free arena.  Return NULL if it can't be done.
+ */
+void *forkscan_nopointers_alloc (size_t size)
+{
+    void *ret = NULL;
+    int shift = NOPTR_MIN_SHIFT;
+
+    pthread_once(&g_init_once, noptr_init);
+    if (0 == g_noptr_span) return NULL;
+
+    while (((size_t)1 << shift) < size) ++shift;
+    if (shift > NOPTR_MAX_SHIFT) return NULL;
+
+    int c = shift - NOPTR_MIN_SHIFT;
+    size_t block = (size_t)1 << shift;
+    noptr_class_t *nc = &g_classes[c];
+
+    pthread_mutex_lock(&nc->lock);
+    if (nc->free_list) {
+        ret = nc->free_list;
+        nc->free_list = nc->free_list->next;
+    } else {
+        if (nc->bump == nc->bump_end) {
+            size_t size = MAX_OF(block, NOPTR_UNIT);
+            size_t chunk = new_chunk(size, c);
+            if (chunk) {
+                nc->bump = chunk;
+                nc->bump_end = chunk + size;
+            }
+        }
+        if (nc->bump < nc->bump_end) {
+            ret = (void*)nc->bump;
+            nc->bump += block;
+        }
+    }
+    pthread_mutex_unlock(&nc->lock);
+
+    return ret;
+}
+
+/**
+ * Return a block to the pointer-free arena.
+ */
+void forkscan_nopointers_free (void *ptr)
+{
+    size_t size = forkscan_nopointers_usable_size((size_t)ptr);
+    int c = g_noptr_class[((size_t)ptr - g_noptr_base) >> NOPTR_UNIT_SHIFT];
+    noptr_class_t *nc = &g_classes[c];
+    free_t *f = (free_t*)ptr;
+
+    assert(forkscan_nopointers_owns((size_t)ptr));
+    if (size >= NOPTR_UNIT) {
+        // Big enough to be worth giving the pages back.  The free list link
+        // lands on a fresh zero page.
+        madvise(ptr, size, MADV_DONTNEED);
+    }
+    pthread_mutex_lock(&nc->lock);
+    f->next = nc->free_list;
+    nc->free_list = f;
+    pthread_mutex_unlock(&nc->lock);
+}
@@ -0,0 +1,76 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Module Description:
+   Arena for objects that hold no pointers (strings, blobs, numeric arrays),
+   handed out by forkscan_malloc_nopointers().  The arena is reserved
+   through alloc.c, so, like Forkscan's own memory, it is never scanned for
+   roots.  Retired objects from it are still candidates, but marking one
+   doesn't trace through it, and freeing one doesn't zero it.
+ */
+
+#ifndef _NOPOINTERS_H_
+#define _NOPOINTERS_H_
+
+#include <stddef.h>
+
+// Blocks are power-of-two sizes from 16 bytes to 1GB.
+#define NOPTR_MIN_SHIFT 4
+#define NOPTR_MAX_SHIFT 30
+
+// Memory is handed to size classes in units of this many bytes.
+#define NOPTR_UNIT_SHIFT 16
+
+#define NOPTR_ARENA_SIZE ((size_t)64 << 30)
+
+extern size_t g_noptr_base;          // Start of the arena.
+extern size_t g_noptr_span;          // Arena size, or zero if not in use.
+extern unsigned char *g_noptr_class; // Size class of each unit.
+
+/**
+ * Return nonzero if addr is in the pointer-free arena.
+ */
+static inline int forkscan_nopointers_owns (size_t addr)
+{
+    return addr - g_noptr_base < g_noptr_span;
+}
+
+/**
+ * Size of the block at addr, which must be in the arena.
+ */
+static inline size_t forkscan_nopointers_usable_size (size_t addr)
+{
+    return (size_t)1 << (NOPTR_MIN_SHIFT + g_noptr_class[
+        (addr - g_noptr_base) >> NOPTR_UNIT_SHIFT]);
+}
+
+/**
+ * Allocate from the pointer-free arena.  Return NULL if it can't be done.
+ */
+void *forkscan_nopointers_alloc (size_t size);
+
+/**
+ * Return a block to the pointer-free arena.
+ */
+void forkscan_nopointers_free (void *ptr);
+
+#endif // !defined _NOPOINTERS_H_
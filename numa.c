@@ -0,0 +1,171 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+#include "alloc.h"
+#include "env.h"
+#include "numa.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "util.h"
+
+/****************************************************************************/
+/*                         Defines, typedefs, etc.                          */
+/****************************************************************************/
+
+// From <numaif.h>, which comes with libnuma rather than libc.
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+#define NODE_POSSIBLE "/sys/devices/system/node/possible"
+
+typedef struct numa_inbox_t numa_inbox_t;
+
+struct numa_inbox_t {
+    pthread_mutex_t lock;
+    numa_chunk_t *head;
+} __attribute__((aligned(64)));
+
+/****************************************************************************/
+/*                                 Globals                                  */
+/****************************************************************************/
+
+int g_numa_nodes = 1;
+
+static numa_inbox_t g_inbox[MAX_NUMA_NODES];
+
+// Chunks live in Forkscan's own, unscanned memory.
+DEFINE_POOL_ALLOC(numachunk, sizeof(numa_chunk_t), 16, forkscan_alloc_mmap)
+
+/****************************************************************************/
+/*                                 Routines                                 */
+/****************************************************************************/
+
+/**
+ * Count the possible NUMA nodes: "0-3" in sysfs means 4.
+ */
+static int count_nodes ()
+{
+    FILE *fp = fopen(NODE_POSSIBLE, "r");
+    int low = 0, high = 0;
+    if (NULL == fp) return 1;
+    if (1 > fscanf(fp, "%d-%d", &low, &high)) high = 0;
+    fclose(fp);
+    return MAX_OF(low, high) + 1;
+}
+
+__attribute__((constructor (201)))
+static void numa_init ()
+{
+    int i, nodes;
+
+    if (!g_forkscan_numa) return;
+    nodes = count_nodes();
+    if (nodes < 2) return;
+
+    for (i = 0; i < MAX_NUMA_NODES; ++i) {
+        pthread_mutex_init(&g_inbox[i].lock, NULL);
+    }
+    g_numa_nodes = MIN_OF(nodes, MAX_NUMA_NODES);
+}
+
+int forkscan_numa_current_node ()
+{
+    unsigned int cpu, node;
+    if (0 != syscall(SYS_getcpu, &cpu, &node, NULL)) return 0;
+    return (int)node;
+}
+
+int forkscan_numa_bind_local (void *addr, size_t len)
+{
+    size_t nodemask;
+    int node;
+
+    if (!forkscan_numa_active()) return 0;
+    node = forkscan_numa_current_node();
+    if (node >= MAX_NUMA_NODES) return -1;
+    nodemask = (size_t)1 << node;
+    // Pages that can't move just stay remote; that isn't an error.
+    return 0 == syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &nodemask,
+                        sizeof(nodemask) * 8, MPOL_MF_MOVE) ? 0 : -1;
+}
+
+void forkscan_numa_lookup (size_t *addrs, int n, signed char *nodes)
+{
+    void *pages[n];
+    int status[n];
+    int i;
+
+    for (i = 0; i < n; ++i) pages[i] = (void*)PAGEALIGN(PTR_MASK(addrs[i]));
+    // With no target nodes, move_pages() only reports where pages are.
+    if (0 != syscall(SYS_move_pages, 0, (unsigned long)n, pages, NULL,
+                     status, 0)) {
+        for (i = 0; i < n; ++i) nodes[i] = -1;
+        return;
+    }
+    for (i = 0; i < n; ++i) {
+        nodes[i] = status[i] >= 0 && status[i] < g_numa_nodes
+            ? (signed char)status[i] : -1;
+    }
+}
+
+numa_chunk_t *forkscan_numa_chunk_new ()
+{
+    numa_chunk_t *chunk = (numa_chunk_t*)pool_alloc_numachunk();
+    chunk->next = NULL;
+    chunk->n_ptrs = 0;
+    return chunk;
+}
+
+void forkscan_numa_chunk_release (numa_chunk_t *chunk)
+{
+    pool_free_numachunk(chunk);
+}
+
+void forkscan_numa_send (int node, numa_chunk_t *chunk)
+{
+    numa_inbox_t *inbox = &g_inbox[node];
+    pthread_mutex_lock(&inbox->lock);
+    chunk->next = inbox->head;
+    inbox->head = chunk;
+    pthread_mutex_unlock(&inbox->lock);
+}
+
+numa_chunk_t *forkscan_numa_receive (int node)
+{
+    numa_inbox_t *inbox = &g_inbox[node];
+    numa_chunk_t *chunk;
+
+    if (NULL == inbox->head) return NULL;
+    pthread_mutex_lock(&inbox->lock);
+    chunk = inbox->head;
+    if (chunk) inbox->head = chunk->next;
+    pthread_mutex_unlock(&inbox->lock);
+    return chunk;
+}
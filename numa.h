@@ -0,0 +1,95 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Module Description:
+   NUMA locality for freeing and for per-thread metadata (FORKSCAN_NUMA).
+   Whichever thread claims a range of dead pointers looks up, in one
+   move_pages() call, which node each block lives on.  Blocks from other
+   nodes are bundled into chunks and posted to that node's inbox, to be
+   cleared and free'd (or cached in a magazine) by a thread running there.
+   On single-node machines none of this is turned on.
+ */
+
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+#include <stddef.h>
+
+// Nodes past this many are treated as local.
+#define MAX_NUMA_NODES 16
+
+// Blocks bundled together for a trip to another node.
+#define NUMA_CHUNK_SZ 84
+
+typedef struct numa_chunk_t numa_chunk_t;
+
+struct numa_chunk_t {
+    numa_chunk_t *next;
+    int n_ptrs;
+    void *ptrs[NUMA_CHUNK_SZ];
+    unsigned int sizes[NUMA_CHUNK_SZ];
+};
+
+extern int g_numa_nodes; // Routing is active when there are at least 2.
+
+/**
+ * Return nonzero if blocks are routed to the node that owns them.
+ */
+static inline int forkscan_numa_active ()
+{
+    return g_numa_nodes > 1;
+}
+
+/**
+ * Return the node the calling thread is running on.
+ */
+int forkscan_numa_current_node ();
+
+/**
+ * Move [addr, addr + len) to the calling thread's node, and keep it there.
+ * addr must be page-aligned (huge-page-aligned for hugetlb memory).
+ * @return 0 on success, -1 if the range couldn't be bound.
+ */
+int forkscan_numa_bind_local (void *addr, size_t len);
+
+/**
+ * Store, in nodes[i], the node holding the block at addrs[i] (ignoring the
+ * low mark bits), or -1 if it can't be found out.
+ */
+void forkscan_numa_lookup (size_t *addrs, int n, signed char *nodes);
+
+numa_chunk_t *forkscan_numa_chunk_new ();
+
+/**
+ * Post a chunk of blocks to the inbox of the node they live on.
+ */
+void forkscan_numa_send (int node, numa_chunk_t *chunk);
+
+/**
+ * Take a chunk from node's inbox, or NULL if it is empty.  The caller
+ * disposes of the blocks and then releases the chunk.
+ */
+numa_chunk_t *forkscan_numa_receive (int node);
+
+void forkscan_numa_chunk_release (numa_chunk_t *chunk);
+
+#endif // !defined _NUMA_H_
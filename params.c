@@ -0,0 +1,241 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "buffer.h"
+#include "env.h"
+#include "forkscan.h"
+#include <fcntl.h>
+#include <limits.h>
+#include "params.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include "tune.h"
+#include <unistd.h>
+#include "util.h"
+
+#define CONFIG_MAX 4096
+
+/****************************************************************************/
+/*                           Typedefs and structs                           */
+/****************************************************************************/
+
+typedef struct param_t param_t;
+
+struct param_t {
+    const char *name;    // Less "FORKSCAN_".
+    volatile int *ival;  // One of these is set.
+    volatile size_t *sval;
+    int shift;           // The value is stored shifted left by this.
+    long long min, max;  // In the parameter's units.
+    void (*apply) ();    // Called after the value changes, or NULL.
+};
+
+/****************************************************************************/
+/*                                 Globals                                  */
+/****************************************************************************/
+
+#define INT_PARAM(name, var, min, max, apply) \
+    { name, (volatile int*)&(var), NULL, 0, min, max, apply }
+#define SIZE_PARAM(name, var, shift, min, max, apply) \
+    { name, NULL, &(var), shift, min, max, apply }
+
+static param_t g_params[] = {
+    // Scanning.
+    INT_PARAM("MAX_CHILDREN", g_forkscan_max_children, 1, MAX_CHILDREN,
+              forkscan_tune_max_children_set),
+    INT_PARAM("LOOKASIDE", g_forkscan_lookaside, 1, LOOKASIDE_SZ, NULL),
+    SIZE_PARAM("RANGE_SIZE_KB", g_forkscan_range_size, 10,
+               MIN_RANGE_SIZE_KB, MAX_RANGE_SIZE_KB, NULL),
+    SIZE_PARAM("CHILD_THRESHOLD_MB", g_forkscan_child_threshold, 20,
+               1, 1 << 20, NULL),
+
+    // Freeing.
+    INT_PARAM("APP_FREES", g_forkscan_app_frees, 0, 1, NULL),
+    INT_PARAM("FREE_LATENCY_NS", g_forkscan_free_latency_ns, 0, INT_MAX,
+              NULL),
+    INT_PARAM("FREE_RANGE", g_forkscan_free_range, 1, FREE_RANGE_SZ, NULL),
+    INT_PARAM("ZERO", g_forkscan_zero, ZERO_FULL, ZERO_MADVISE, NULL),
+
+    // Throttling.  Queues can shrink, but not grow past the size they
+    // were allocated at.
+    SIZE_PARAM("PTRS_PER_THREAD", g_forkscan_queue_limit, 10,
+               MIN_PTRS_PER_THREAD >> 10, INT_MAX >> 10,
+               forkscan_tune_queue_limit_set),
+    INT_PARAM("THROTTLING_QUEUE", g_forkscan_throttling_queue,
+              1, MAX_THROTTLING_QUEUE, forkscan_tune_throttling_queue_set),
+    SIZE_PARAM("MEMORY_TARGET_MB", g_forkscan_memory_target, 20,
+               0, INT_MAX, forkscan_util_memory_target_set),
+
+    // Scheduling.
+    INT_PARAM("PERIOD_MS", g_forkscan_period_ms, 0, INT_MAX,
+              forkscan_reschedule),
+    INT_PARAM("MAX_LATENCY_MS", g_forkscan_max_latency_ms, 0, INT_MAX,
+              forkscan_reschedule),
+    INT_PARAM("TRIGGER_MIN", g_forkscan_trigger_min, 1, INT_MAX, NULL),
+
+    // Tuning.
+    INT_PARAM("AUTOTUNE", g_forkscan_autotune, 0, 1, NULL),
+    INT_PARAM("TUNE_OVERHEAD", g_forkscan_tune_overhead, 1, 100, NULL),
+};
+
+#define N_PARAMS (sizeof(g_params) / sizeof(g_params[0]))
+
+// Serializes changes, so an apply() sees the values it was called for.
+static pthread_mutex_t g_params_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// When the config file was last read.
+static struct timespec g_config_mtime;
+
+/****************************************************************************/
+/*                                 Helpers                                  */
+/****************************************************************************/
+
+static param_t *find_param (const char *name)
+{
+    int i;
+    if (0 == strncasecmp(name, "FORKSCAN_", 9)) name += 9;
+    for (i = 0; i < N_PARAMS; ++i) {
+        if (0 == strcasecmp(name, g_params[i].name)) return &g_params[i];
+    }
+    return NULL;
+}
+
+/**
+ * Apply "name = value" lines from buf.  Bad lines get a diagnostic.
+ */
+static void apply_config (char *buf, const char *path)
+{
+    char *line, *save;
+    int lineno = 0;
+
+    for (line = strtok_r(buf, "\n", &save); line;
+         line = strtok_r(NULL, "\n", &save)) {
+        char *comment = strchr(line, '#'), *eq, *end;
+        long long value;
+
+        ++lineno;
+        if (comment) *comment = '\0';
+        line += strspn(line, " \t");
+        if ('\0' == *line) continue;
+        eq = strchr(line, '=');
+        if (NULL == eq) {
+            forkscan_diagnostic("%s:%d: expected \"name = value\"\n",
+                                path, lineno);
+            continue;
+        }
+        // Trim the name.
+        for (end = eq; end > line && (' ' == end[-1] || '\t' == end[-1]);
+             --end);
+        *end = '\0';
+        value = strtoll(eq + 1, &end, 0);
+        if (end == eq + 1 || end[strspn(end, " \t\r")] != '\0') {
+            forkscan_diagnostic("%s:%d: bad value for %s\n",
+                                path, lineno, line);
+        } else if (0 != forkscan_params_set(line, value)) {
+            forkscan_diagnostic("%s:%d: unknown parameter %s\n",
+                                path, lineno, line);
+        }
+    }
+}
+
+__attribute__((constructor (202)))
+static void params_init ()
+{
+    forkscan_params_reload();
+}
+
+/****************************************************************************/
+/*                            Exported functions                            */
+/****************************************************************************/
+
+/**
+ * Set the parameter "name" to value, clamped to the range it allows.
+ * @return 0 on success, -1 if there is no such parameter.
+ */
+int forkscan_params_set (const char *name, long long value)
+{
+    param_t *p = find_param(name);
+    int changed;
+
+    if (NULL == p) return -1;
+    value = MAX_OF(MIN_OF(value, p->max), p->min);
+    pthread_mutex_lock(&g_params_lock);
+    if (p->ival) {
+        changed = *p->ival != (int)value;
+        *p->ival = (int)value;
+    } else {
+        changed = *p->sval != (size_t)value << p->shift;
+        *p->sval = (size_t)value << p->shift;
+    }
+    if (changed && p->apply) p->apply();
+    pthread_mutex_unlock(&g_params_lock);
+    return 0;
+}
+
+/**
+ * Store the current value of the parameter "name" in *value.
+ * @return 0 on success, -1 if there is no such parameter.
+ */
+int forkscan_params_get (const char *name, long long *value)
+{
+    param_t *p = find_param(name);
+
+    if (NULL == p) return -1;
+    if (p->ival) *value = *p->ival;
+    else *value = (long long)(*p->sval >> p->shift);
+    return 0;
+}
+
+/**
+ * Re-read the FORKSCAN_CONFIG file if it has changed since it was last
+ * read.
+ */
+void forkscan_params_reload ()
+{
+    const char *path = g_forkscan_config;
+    char buf[CONFIG_MAX];
+    struct stat st;
+    ssize_t len;
+    int fd;
+
+    if (NULL == path || 0 != stat(path, &st)) return;
+    if (st.st_mtim.tv_sec == g_config_mtime.tv_sec
+        && st.st_mtim.tv_nsec == g_config_mtime.tv_nsec) {
+        return;
+    }
+    g_config_mtime = st.st_mtim;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len < 0) return;
+    if (len == sizeof(buf) - 1) {
+        forkscan_diagnostic("%s: only the first %d bytes are read.\n",
+                            path, CONFIG_MAX - 1);
+    }
+    buf[len] = '\0';
+    apply_config(buf, path);
+}
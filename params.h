@@ -0,0 +1,57 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Module Description:
+   Runtime parameters.  The settings that are safe to change in a running
+   process (scanning, freeing, throttling, scheduling and tuning) can be
+   read and set by name through forkscan_get_param()/forkscan_set_param().
+   Names are the environment variables', with or without "FORKSCAN_", in
+   any case, and values are in the same units.  A change takes effect at
+   the next iteration at the latest.
+
+   FORKSCAN_CONFIG names a file of "name = value" lines ('#' starts a
+   comment).  It is applied over the environment at startup, and again
+   whenever it changes; the GC thread checks each time it wakes.
+ */
+
+#ifndef _PARAMS_H_
+#define _PARAMS_H_
+
+/**
+ * Set the parameter "name" to value, clamped to the range it allows.
+ * @return 0 on success, -1 if there is no such parameter.
+ */
+int forkscan_params_set (const char *name, long long value);
+
+/**
+ * Store the current value of the parameter "name" in *value.
+ * @return 0 on success, -1 if there is no such parameter.
+ */
+int forkscan_params_get (const char *name, long long *value);
+
+/**
+ * Re-read the FORKSCAN_CONFIG file if it has changed since it was last
+ * read.
+ */
+void forkscan_params_reload ();
+
+#endif // !defined _PARAMS_H_
@@ -0,0 +1,317 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include "env.h"
+#include <fcntl.h>
+#include "forkscan.h"
+#include <limits.h>
+#include <poll.h>
+#include "pressure.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "util.h"
+
+// PSI trigger window.  Unprivileged triggers need a multiple of 2s.
+#define PSI_WINDOW_US 2000000
+
+// How long, and in what steps, a fork is held off for lack of headroom.
+#define HEADROOM_WAIT_MAX_MS 1000
+#define HEADROOM_WAIT_MS 10
+
+// A snapshot is expected to copy about 1/2^COW_ESTIMATE_SHIFT of the
+// resident memory before the child is done with it.
+#define COW_ESTIMATE_SHIFT 2
+
+/****************************************************************************/
+/*                                 Globals                                  */
+/****************************************************************************/
+
+size_t g_forkscan_pressure_events;
+size_t g_forkscan_pressure_holds;
+
+// This process's cgroup v2 directory, if there is one, and the files with
+// its memory limits and usage (v2 or v1).  Empty strings if not found.
+static char g_cgroup_dir[PATH_MAX];
+static char g_limit_path[PATH_MAX];
+static char g_high_path[PATH_MAX];
+static char g_usage_path[PATH_MAX];
+
+// Last sum of the high, max and oom counts in memory.events.
+static long long g_memory_events;
+
+/****************************************************************************/
+/*                                 Helpers                                  */
+/****************************************************************************/
+
+/**
+ * Read a file into buf, NUL-terminated.  Return the length, or -1.
+ */
+static ssize_t read_file (const char *path, char *buf, size_t size)
+{
+    int fd = open(path, O_RDONLY);
+    ssize_t len;
+    if (fd < 0) return -1;
+    len = read(fd, buf, size - 1);
+    close(fd);
+    if (len >= 0) buf[len] = '\0';
+    return len;
+}
+
+/**
+ * Read a byte count like memory.max's.  -1 if it's missing or "max".
+ */
+static long long read_bytes (const char *path)
+{
+    char buf[64];
+    long long val;
+    if (!path[0] || read_file(path, buf, sizeof(buf)) <= 0) return -1;
+    if (1 != sscanf(buf, "%lld", &val)) return -1;
+    return val;
+}
+
+static int exists (const char *path)
+{
+    return 0 == access(path, R_OK);
+}
+
+/**
+ * Write "dir/file" into buf, a PATH_MAX buffer.  Return whether it fit;
+ * if not, buf is left empty.
+ */
+static int join (char *buf, const char *dir, const char *file)
+{
+    if (snprintf(buf, PATH_MAX, "%s/%s", dir, file) < PATH_MAX) return 1;
+    buf[0] = '\0';
+    return 0;
+}
+
+/**
+ * Find this process's memory cgroup from /proc/self/cgroup: the v2
+ * directory ("0::/path") if it has memory files, otherwise the v1 memory
+ * controller's ("N:memory:/path").
+ */
+static void find_cgroup ()
+{
+    char buf[4096], dir[PATH_MAX], *line, *save;
+    const char *v2_roots[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+    int i;
+
+    if (read_file("/proc/self/cgroup", buf, sizeof(buf)) <= 0) return;
+    for (line = strtok_r(buf, "\n", &save); line;
+         line = strtok_r(NULL, "\n", &save)) {
+        // id:controllers:path
+        char *controllers = strchr(line, ':'), *path;
+        if (NULL == controllers) continue;
+        if (NULL == (path = strchr(controllers + 1, ':'))) continue;
+        ++path;
+        if (0 == strncmp(line, "0::", 3)) {
+            if (0 == strcmp(path, "/")) path = "";
+            for (i = 0; i < 2 && !g_cgroup_dir[0]; ++i) {
+                char pressure[PATH_MAX];
+                if (snprintf(dir, sizeof(dir), "%s%s", v2_roots[i], path)
+                    >= sizeof(dir)) {
+                    continue;
+                }
+                if (join(pressure, dir, "memory.pressure")
+                    && exists(pressure)) {
+                    strcpy(g_cgroup_dir, dir);
+                }
+            }
+        } else if (strstr(line, ":memory:") && !g_usage_path[0]) {
+            if (snprintf(dir, sizeof(dir), "/sys/fs/cgroup/memory%s", path)
+                >= sizeof(dir)) {
+                continue;
+            }
+            join(g_limit_path, dir, "memory.limit_in_bytes");
+            if (!join(g_usage_path, dir, "memory.usage_in_bytes")
+                || !exists(g_usage_path)) {
+                g_limit_path[0] = g_usage_path[0] = '\0';
+            }
+        }
+    }
+
+    if (g_cgroup_dir[0]) {
+        char usage[PATH_MAX];
+        if (join(usage, g_cgroup_dir, "memory.current") && exists(usage)) {
+            // The v2 files win.
+            strcpy(g_usage_path, usage);
+            join(g_limit_path, g_cgroup_dir, "memory.max");
+            join(g_high_path, g_cgroup_dir, "memory.high");
+        }
+    }
+}
+
+/**
+ * Open path and register a PSI trigger on it: a stall of
+ * FORKSCAN_PRESSURE_STALL_MS in any window.  Return the fd, or -1.
+ */
+static int open_psi_trigger (const char *path)
+{
+    char trigger[64];
+    int fd = open(path, O_RDWR | O_NONBLOCK);
+    if (fd < 0) return -1;
+    snprintf(trigger, sizeof(trigger), "some %lld %d",
+             (long long)g_forkscan_pressure_stall_ms * 1000, PSI_WINDOW_US);
+    if (write(fd, trigger, strlen(trigger) + 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Re-read memory.events.  Return whether the cgroup has hit memory.high,
+ * memory.max or the OOM killer since the last look.
+ */
+static int memory_events_rose (int fd)
+{
+    char buf[512], *p;
+    long long sum = 0, val;
+    int rose;
+    ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+
+    if (len <= 0) return 0;
+    buf[len] = '\0';
+    for (p = buf; p; p = strchr(p, '\n')) {
+        if ('\n' == *p) ++p;
+        if (1 == sscanf(p, "high %lld", &val)
+            || 1 == sscanf(p, "max %lld", &val)
+            || 1 == sscanf(p, "oom %lld", &val)) {
+            sum += val;
+        }
+    }
+    rose = sum > g_memory_events;
+    g_memory_events = sum;
+    return rose;
+}
+
+/**
+ * Return whether the cgroup's memory limit leaves room for the pages a
+ * snapshot is expected to copy.
+ */
+static int has_headroom ()
+{
+    long long limit = read_bytes(g_limit_path);
+    long long high = read_bytes(g_high_path);
+    long long usage = read_bytes(g_usage_path);
+    long long resident;
+    char statm[128];
+
+    if (high >= 0 && (limit < 0 || high < limit)) limit = high;
+    if (limit < 0 || usage < 0) return 1;
+    if (read_file("/proc/self/statm", statm, sizeof(statm)) <= 0
+        || 1 != sscanf(statm, "%*s %lld", &resident)) {
+        return 1;
+    }
+    resident *= PAGESIZE;
+    return limit - usage > resident >> COW_ESTIMATE_SHIFT;
+}
+
+__attribute__((constructor (201)))
+static void pressure_init ()
+{
+    if (g_forkscan_pressure) find_cgroup();
+}
+
+/****************************************************************************/
+/*                            Exported functions                            */
+/****************************************************************************/
+
+/**
+ * Memory-pressure watcher thread.  Started alongside the GC thread, and
+ * like it, not one of the application's threads.
+ */
+void *forkscan_pressure_thread (void *ignored)
+{
+    struct pollfd fds[2];
+    char path[PATH_MAX];
+    int n = 0, events_idx = -1;
+
+    if (g_cgroup_dir[0] && join(path, g_cgroup_dir, "memory.pressure")) {
+        fds[n].fd = open_psi_trigger(path);
+        if (fds[n].fd >= 0) ++n;
+    }
+    if (0 == n) {
+        fds[n].fd = open_psi_trigger("/proc/pressure/memory");
+        if (fds[n].fd >= 0) ++n;
+    }
+    if (g_cgroup_dir[0] && join(path, g_cgroup_dir, "memory.events")) {
+        fds[n].fd = open(path, O_RDONLY);
+        if (fds[n].fd >= 0) {
+            memory_events_rose(fds[n].fd);
+            events_idx = n++;
+        }
+    }
+    if (0 == n) {
+        forkscan_diagnostic("No memory pressure information available.\n");
+        return NULL;
+    }
+
+    while (1) {
+        int i, pressure = 0;
+        for (i = 0; i < n; ++i) {
+            fds[i].events = POLLPRI;
+            fds[i].revents = 0;
+        }
+        if (poll(fds, n, -1) < 0) {
+            if (EINTR == errno) continue;
+            forkscan_diagnostic("Memory pressure watcher failed.\n");
+            return NULL;
+        }
+        for (i = 0; i < n; ++i) {
+            if (0 == (fds[i].revents & (POLLPRI | POLLERR))) continue;
+            if (i == events_idx) pressure |= memory_events_rose(fds[i].fd);
+            else if (fds[i].revents & POLLERR) {
+                // The cgroup went away.
+                forkscan_diagnostic("Lost the memory pressure trigger.\n");
+                return NULL;
+            } else pressure = 1;
+        }
+        if (pressure) {
+            ++g_forkscan_pressure_events;
+            forkscan_request_collection();
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Wait, for a bounded time, until the cgroup has room for a snapshot.
+ * Returns at once if there is no limit or no watcher.
+ */
+void forkscan_pressure_wait_for_headroom ()
+{
+    int waited;
+
+    if (!g_forkscan_pressure || !g_usage_path[0]) return;
+    for (waited = 0; waited < HEADROOM_WAIT_MAX_MS;
+         waited += HEADROOM_WAIT_MS) {
+        if (has_headroom()) return;
+        // Freers and retiring threads keep free'ing in the meantime.
+        if (0 == waited) ++g_forkscan_pressure_holds;
+        usleep(HEADROOM_WAIT_MS * 1000);
+    }
+}
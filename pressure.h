@@ -0,0 +1,55 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Module Description:
+   Memory-pressure watcher (FORKSCAN_PRESSURE).  A thread of its own polls
+   a PSI trigger on the cgroup's memory.pressure (or, failing that,
+   /proc/pressure/memory) and the cgroup's memory.events.  When memory gets
+   tight, it asks the GC thread for an iteration, which also trims
+   Forkscan's pools and wakes the freers.  Before each fork, the GC thread
+   checks here that the cgroup has room for the snapshot's copy-on-write
+   growth, and holds off for a while if it doesn't.
+ */
+
+#ifndef _PRESSURE_H_
+#define _PRESSURE_H_
+
+#include <stddef.h>
+
+// Times pressure was reported, and times a fork was held off for lack of
+// headroom.
+extern size_t g_forkscan_pressure_events;
+extern size_t g_forkscan_pressure_holds;
+
+/**
+ * Memory-pressure watcher thread.  Started alongside the GC thread, and
+ * like it, not one of the application's threads.
+ */
+void *forkscan_pressure_thread (void *ignored);
+
+/**
+ * Wait, for a bounded time, until the cgroup has room for a snapshot.
+ * Returns at once if there is no limit or no watcher.
+ */
+void forkscan_pressure_wait_for_headroom ();
+
+#endif // !defined _PRESSURE_H_
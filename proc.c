@@ -23,15 +23,34 @@ THE SOFTWARE.
 #define _GNU_SOURCE // For pthread_yield().
 #include "alloc.h"
 #include <assert.h>
+#include "env.h"
 #include <errno.h>
+#include "forkscan.h"
 #include "proc.h"
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include "util.h"
 
+// Each thread stopped for a snapshot passes the signal on to this many
+// others, so the signals go out in O(log n) rounds.
+#define STW_FANOUT 4
+
+// GC-thread spins on a stopping thread before signalling it directly, in
+// case whoever was to relay the signal exited.
+#define STW_RESIGNAL_SPINS 4096
+
+// In safepoint mode, how long the GC thread waits for a thread to reach a
+// safepoint before signalling it after all.  It may be stuck in a call
+// that isn't a blocking region, waiting on a thread that has stopped.
+#define STW_SAFEPOINT_WAIT_NS (10 * 1000 * 1000)
+
+// Every thread the wrappers let through, plus the main thread.
+#define STW_MAX_TARGETS (MAX_THREAD_COUNT + 2)
+
 /****************************************************************************/
 /*                                 Structs                                  */
 /****************************************************************************/
@@ -153,20 +172,16 @@ void forkscan_proc_stack_from_addr (mem_range_t *mem_range, size_t addr)
     fclose(fp);
 }
 
-void forkscan_proc_map_iterate (int (*f) (void *arg,
-                                          size_t begin,
-                                          size_t end,
-                                          const char *bits,
-                                          const char *path),
-                                void *user_arg)
+static void map_iterate (FILE *fp,
+                         int (*f) (void *arg,
+                                   size_t begin,
+                                   size_t end,
+                                   const char *bits,
+                                   const char *path),
+                         void *user_arg)
 {
-    FILE *fp;
     mapline_t mapline;
 
-    if (NULL == (fp = fopen(procmap, "r"))) {
-        forkscan_fatal("unable to open memory map file.\n");
-    }
-
     while (read_mapline(fp, &mapline)) {
         if (0 == f(user_arg,
                    mapline.range_begin,
@@ -177,10 +192,48 @@ void forkscan_proc_map_iterate (int (*f) (void *arg,
             break;
         }
     }
+}
+
+void forkscan_proc_map_iterate (int (*f) (void *arg,
+                                          size_t begin,
+                                          size_t end,
+                                          const char *bits,
+                                          const char *path),
+                                void *user_arg)
+{
+    FILE *fp;
+
+    if (NULL == (fp = fopen(procmap, "r"))) {
+        forkscan_fatal("unable to open memory map file.\n");
+    }
+
+    map_iterate(fp, f, user_arg);
 
     //fclose(fp); // FIXME: Need to make this explicit, somehow.
 }
 
+/**
+ * Like forkscan_proc_map_iterate(), but the maps file is closed afterward.
+ * Use this from long-lived threads, which would otherwise leak the file.
+ */
+void forkscan_proc_map_iterate_and_close (int (*f) (void *arg,
+                                                    size_t begin,
+                                                    size_t end,
+                                                    const char *bits,
+                                                    const char *path),
+                                          void *user_arg)
+{
+    FILE *fp;
+
+    if (NULL == (fp = fopen(procmap, "r"))) {
+        forkscan_fatal("unable to open memory map file.\n");
+    }
+
+    map_iterate(fp, f, user_arg);
+
+    fclose(fp);
+}
+
 /****************************************************************************/
 /*                             Per-thread data                              */
 /****************************************************************************/
@@ -235,30 +288,97 @@ int forkscan_proc_signal_all_except (int sig, thread_data_t *except)
 }
 
 /**
- * Send a signal to all threads in the process using pthread_kill().
+ * Threads being stopped for the current snapshot, in relay order: thread i
+ * signals threads (i + 1) * STW_FANOUT through (i + 2) * STW_FANOUT - 1.
  */
-int forkscan_proc_signal (int sig)
+static thread_data_t *g_stw_targets[STW_MAX_TARGETS];
+static volatile int g_stw_n_targets;
+static volatile int g_stw_sig;
+static pid_t g_stw_pid;
+
+static void stw_kill (thread_data_t *td)
+{
+    // tgkill(), unlike pthread_kill(), is safe to call from a handler.
+    syscall(SYS_tgkill, g_stw_pid, td->tid, g_stw_sig);
+}
+
+/**
+ * Start stopping every active thread for the snapshot of the given round.
+ * Only the first few are signalled here; each of them passes the signal
+ * on (forkscan_proc_relay_signal()).  With sig 0 nobody is signalled, and
+ * threads stop when they reach a safepoint.  Return the number of threads.
+ */
+int forkscan_proc_signal_tree (int sig, int round)
 {
-    int signal_count = 0;
     thread_data_t *td;
+    int i, n = 0;
 
-    // Yay!  C doesn't have lambdas!  So this is way uglier and more fragile
-    // than it needs to be!  Thanks, C.
     FOREACH_IN_THREAD_LIST(td, &thread_list)
         assert(td);
-        if (td->is_active) {
-            int ret = pthread_kill(td->self, sig);
-            if (EINVAL == ret) {
-                forkscan_fatal("pthread_kill() returned EINVAL.\n");
-            } else if (ESRCH == ret) {
-                forkscan_diagnostic("pthread_kill() returned ESRCH.\n");
-            } else {
-                ++signal_count;
-            }
+        // Blocked threads sit this one out, and wait at the exit from
+        // their blocking region if it's still going on.
+        if (td->is_active && !td->blocking) {
+            assert(n < STW_MAX_TARGETS);
+            // Keep td around, even if its thread exits, until the
+            // handshake is over (forkscan_proc_wait_for_acks()).
+            __sync_fetch_and_add(&td->ref_count, 1);
+            td->stw_index = n;
+            g_stw_targets[n++] = td;
         }
     ENDFOREACH_IN_THREAD_LIST(td, &thread_list);
 
-    return signal_count;
+    g_stw_n_targets = n;
+    g_stw_sig = sig;
+    g_stw_pid = getpid();
+    __sync_synchronize();
+
+    if (0 == sig) return n;
+    for (i = 0; i < MIN_OF(n, STW_FANOUT); ++i) stw_kill(g_stw_targets[i]);
+    return n;
+}
+
+/**
+ * Pass the snapshot signal on to td's children in the relay tree.  Called
+ * from the signal handler.
+ */
+void forkscan_proc_relay_signal (thread_data_t *td)
+{
+    int i, first = (td->stw_index + 1) * STW_FANOUT;
+    for (i = first; i < first + STW_FANOUT && i < g_stw_n_targets; ++i) {
+        stw_kill(g_stw_targets[i]);
+    }
+}
+
+/**
+ * Wait until every thread stopping for the given round has acknowledged
+ * it on its own cache line, exited, or entered a blocking region.  Drops
+ * the references forkscan_proc_signal_tree() took.
+ */
+void forkscan_proc_wait_for_acks (int round)
+{
+    int i;
+    for (i = 0; i < g_stw_n_targets; ++i) {
+        thread_data_t *td = g_stw_targets[i];
+        size_t deadline = 0;
+        int spins = 0;
+        while (td->stw_ack != round && td->is_active && !td->blocking) {
+            if (++spins % STW_RESIGNAL_SPINS == 0) {
+                if (g_stw_sig) stw_kill(td);
+                else if (0 == deadline) {
+                    deadline = forkscan_util_ns() + STW_SAFEPOINT_WAIT_NS;
+                } else if (forkscan_util_ns() >= deadline) {
+                    // The handler is installed either way.
+                    syscall(SYS_tgkill, g_stw_pid, td->tid, SIGFORKSCAN);
+                    deadline = forkscan_util_ns() + STW_SAFEPOINT_WAIT_NS;
+                }
+                pthread_yield();
+            }
+            __builtin_ia32_pause();
+        }
+    }
+    for (i = 0; i < g_stw_n_targets; ++i) {
+        forkscan_util_thread_data_decr_ref(g_stw_targets[i]);
+    }
 }
 
 /**
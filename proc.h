@@ -50,6 +50,17 @@ void forkscan_proc_map_iterate (int (*f) (void *arg,
                                           const char *path),
                                 void *user_arg);
 
+/**
+ * Like forkscan_proc_map_iterate(), but the maps file is closed afterward.
+ * Use this from long-lived threads, which would otherwise leak the file.
+ */
+void forkscan_proc_map_iterate_and_close (int (*f) (void *arg,
+                                                    size_t begin,
+                                                    size_t end,
+                                                    const char *bits,
+                                                    const char *path),
+                                          void *user_arg);
+
 /****************************************************************************/
 /*                             Per-thread data                              */
 /****************************************************************************/
@@ -72,9 +83,25 @@ void forkscan_proc_remove_thread_data (thread_data_t *td);
 int forkscan_proc_signal_all_except (int sig, thread_data_t *except);
 
 /**
- * Send a signal to all threads in the process using pthread_kill().
+ * Start stopping every active thread for the snapshot of the given round.
+ * Only the first few are signalled here; each of them passes the signal
+ * on (forkscan_proc_relay_signal()).  With sig 0 nobody is signalled, and
+ * threads stop when they reach a safepoint.  Return the number of threads.
+ */
+int forkscan_proc_signal_tree (int sig, int round);
+
+/**
+ * Pass the snapshot signal on to td's children in the relay tree.  Called
+ * from the signal handler.
+ */
+void forkscan_proc_relay_signal (thread_data_t *td);
+
+/**
+ * Wait until every thread stopping for the given round has acknowledged
+ * it on its own cache line, exited, or entered a blocking region.  Drops
+ * the references forkscan_proc_signal_tree() took.
  */
-int forkscan_proc_signal (int sig);
+void forkscan_proc_wait_for_acks (int round);
 
 /**
  * Wait for all threads that are trying to help out to discover the
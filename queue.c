@@ -38,10 +38,29 @@ void forkscan_queue_init (queue_t *q, size_t *buf, size_t capacity)
 {
     q->e = buf;
     q->capacity = capacity;
+    q->limit = capacity;
     q->idx_head = 0;
     q->idx_tail = capacity;
 }
 
+/**
+ * Let the queue hold no more than "limit" values (fewer than capacity).
+ * Values already queued past the limit stay put; the queue just reads as
+ * full until it is drained.
+ */
+void forkscan_queue_set_limit (queue_t *q, size_t limit)
+{
+    q->limit = MAX_OF(MIN_OF(limit, q->capacity), 2);
+}
+
+/**
+ * Return the number of values in the queue.
+ */
+size_t forkscan_queue_length (queue_t *q)
+{
+    return q->capacity - (q->idx_tail - q->idx_head);
+}
+
 /**
  * Return 1 if the queue is empty, zero otherwise.
  */
@@ -57,7 +76,7 @@ int forkscan_queue_is_empty (queue_t *q)
 int forkscan_queue_is_full (queue_t *q)
 {
     assert(q->idx_head < q->idx_tail);
-    return q->idx_head + 1 >= q->idx_tail ? 1 : 0;
+    return forkscan_queue_length(q) + 1 >= q->limit ? 1 : 0;
 }
 
 /**
@@ -67,9 +86,8 @@ int forkscan_queue_available (queue_t *q)
 {
     assert(q->idx_head < q->idx_tail);
     // We can use an int since the two values are actually very close.
-    int ret = (int)(q->idx_tail - q->idx_head - 1);
-    assert(ret >= 0);
-    return ret;
+    int ret = (int)q->limit - (int)forkscan_queue_length(q) - 1;
+    return MAX_OF(ret, 0);
 }
 
 /**
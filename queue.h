@@ -45,6 +45,7 @@ typedef struct queue_t queue_t;
 struct queue_t {
     size_t *e;                    // Buffer of elements.
     size_t capacity;              // Max storage.
+    volatile size_t limit;        // Slots in use, of capacity.
     unsigned long long idx_head;  // Absolute idx: where values are inserted.
     unsigned long long idx_tail;  // Absolute idx: where values are removed.
 };
@@ -58,6 +59,18 @@ struct queue_t {
  */
 void forkscan_queue_init (queue_t *q, size_t *buf, size_t capacity);
 
+/**
+ * Let the queue hold no more than "limit" values (fewer than capacity).
+ * Values already queued past the limit stay put; the queue just reads as
+ * full until it is drained.
+ */
+void forkscan_queue_set_limit (queue_t *q, size_t limit);
+
+/**
+ * Return the number of values in the queue.
+ */
+size_t forkscan_queue_length (queue_t *q);
+
 /**
  * Return 1 if the queue is empty, zero otherwise.
  */
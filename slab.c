@@ -0,0 +1,254 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "alloc.h"
+#include <assert.h>
+#include "env.h"
+#include <pthread.h>
+#include "slab.h"
+#include <sys/mman.h>
+#include "util.h"
+
+/****************************************************************************/
+/*                         Defines, typedefs, etc.                          */
+/****************************************************************************/
+
+// How much of the reserved arena is made accessible at a time.
+#define SLAB_GROW_SIZE ((size_t)4 * 1024 * 1024)
+
+#define N_SLABS (SLAB_ARENA_SIZE >> SLAB_SHIFT)
+#define N_GRANULES (SLAB_ARENA_SIZE >> SLAB_GRANULE_SHIFT)
+#define BITS_PER_WORD (sizeof(size_t) * 8)
+
+typedef struct slab_class_t slab_class_t;
+
+struct slab_class_t
+{
+    pthread_mutex_t lock;
+    size_t obj_size;
+    free_t *free_list;
+    size_t bump, bump_end; // Unused part of the current slab.
+};
+
+/****************************************************************************/
+/*                                 Globals                                  */
+/****************************************************************************/
+
+size_t g_slab_base;
+size_t g_slab_span;
+slab_meta_t *g_slab_meta;
+size_t *g_slab_candidates;
+size_t *g_slab_marks;
+
+static const unsigned int g_class_sizes[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+#define N_CLASSES (sizeof(g_class_sizes) / sizeof(g_class_sizes[0]))
+
+static slab_class_t g_classes[N_CLASSES];
+
+// Size (in granules) to class.
+static unsigned char g_class_of[(SLAB_MAX_OBJECT >> SLAB_GRANULE_SHIFT) + 1];
+
+static pthread_mutex_t g_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_arena_top;       // Offset of the next new slab.
+static size_t g_arena_committed; // Offset of the end of accessible memory.
+
+/****************************************************************************/
+/*                                 Helpers                                  */
+/****************************************************************************/
+
+static size_t granule_of (size_t addr)
+{
+    return (addr - g_slab_base) >> SLAB_GRANULE_SHIFT;
+}
+
+/**
+ * Get a fresh slab from the arena.  Return 0 if it is exhausted.
+ */
+static size_t new_slab ()
+{
+    size_t slab = 0;
+
+    pthread_mutex_lock(&g_arena_lock);
+    if (g_arena_top + SLAB_SIZE <= g_arena_committed) {
+        slab = g_slab_base + g_arena_top;
+        g_arena_top += SLAB_SIZE;
+    } else if (g_arena_committed + SLAB_GROW_SIZE <= SLAB_ARENA_SIZE) {
+        if (0 == mprotect((void*)(g_slab_base + g_arena_committed),
+                          SLAB_GROW_SIZE, PROT_READ | PROT_WRITE)) {
+            g_arena_committed += SLAB_GROW_SIZE;
+            slab = g_slab_base + g_arena_top;
+            g_arena_top += SLAB_SIZE;
+        }
+    }
+    pthread_mutex_unlock(&g_arena_lock);
+
+    return slab;
+}
+
+/****************************************************************************/
+/*                                Interface                                 */
+/****************************************************************************/
+
+/**
+ * Allocate from the slab arena.  Return NULL if size is too big or the
+ * arena is exhausted.
+ */
+void *forkscan_slab_alloc (size_t size)
+{
+    void *ret = NULL;
+
+    if (0 == g_slab_span || size > SLAB_MAX_OBJECT) return NULL;
+    slab_class_t *sc = &g_classes[g_class_of[(size + (1 << SLAB_GRANULE_SHIFT)
+                                              - 1) >> SLAB_GRANULE_SHIFT]];
+
+    pthread_mutex_lock(&sc->lock);
+    if (sc->free_list) {
+        ret = sc->free_list;
+        sc->free_list = sc->free_list->next;
+    } else {
+        if (sc->bump == sc->bump_end) {
+            size_t slab = new_slab();
+            if (slab) {
+                slab_meta_t *meta =
+                    &g_slab_meta[(slab - g_slab_base) >> SLAB_SHIFT];
+                meta->obj_size = sc->obj_size;
+                meta->size_class = sc - g_classes;
+                sc->bump = slab;
+                sc->bump_end = slab + (SLAB_SIZE / sc->obj_size)
+                    * sc->obj_size;
+            }
+        }
+        if (sc->bump < sc->bump_end) {
+            ret = (void*)sc->bump;
+            sc->bump += sc->obj_size;
+        }
+    }
+    pthread_mutex_unlock(&sc->lock);
+
+    return ret;
+}
+
+/**
+ * Return an object to its slab.
+ */
+void forkscan_slab_free (void *ptr)
+{
+    slab_meta_t *meta = &g_slab_meta[((size_t)ptr - g_slab_base)
+                                     >> SLAB_SHIFT];
+    slab_class_t *sc = &g_classes[meta->size_class];
+    free_t *f = (free_t*)ptr;
+
+    assert(forkscan_slab_owns((size_t)ptr));
+    pthread_mutex_lock(&sc->lock);
+    f->next = sc->free_list;
+    sc->free_list = f;
+    pthread_mutex_unlock(&sc->lock);
+}
+
+/**
+ * Flag the arena objects in addrs as candidates.
+ */
+void forkscan_slab_set_candidates (size_t *addrs, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i) {
+        size_t addr = PTR_MASK(addrs[i]);
+        if (!forkscan_slab_owns(addr)) continue;
+        size_t g = granule_of(addr);
+        g_slab_candidates[g / BITS_PER_WORD] |=
+            (size_t)1 << (g % BITS_PER_WORD);
+    }
+}
+
+/**
+ * Mark addr if it is a candidate.  Return 1 if this call did the marking,
+ * zero if it isn't a candidate or was already marked.
+ */
+int forkscan_slab_mark (size_t addr)
+{
+    if (addr & ((1 << SLAB_GRANULE_SHIFT) - 1)) return 0; // Not a start.
+    size_t g = granule_of(addr);
+    size_t bit = (size_t)1 << (g % BITS_PER_WORD);
+    if (0 == (g_slab_candidates[g / BITS_PER_WORD] & bit)) return 0;
+    if (g_slab_marks[g / BITS_PER_WORD] & bit) return 0;
+    size_t old = __sync_fetch_and_or(&g_slab_marks[g / BITS_PER_WORD], bit);
+    return 0 == (old & bit);
+}
+
+/**
+ * Copy the marks into the low bit of addrs and clear the candidate and mark
+ * bits for the next iteration.
+ */
+void forkscan_slab_collect_marks (size_t *addrs, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i) {
+        size_t addr = PTR_MASK(addrs[i]);
+        if (!forkscan_slab_owns(addr)) continue;
+        size_t g = granule_of(addr);
+        size_t bit = (size_t)1 << (g % BITS_PER_WORD);
+        if (g_slab_marks[g / BITS_PER_WORD] & bit) addrs[i] |= 0x1;
+        g_slab_marks[g / BITS_PER_WORD] &= ~bit;
+        g_slab_candidates[g / BITS_PER_WORD] &= ~bit;
+    }
+}
+
+__attribute__((constructor (201)))
+static void slab_init ()
+{
+    size_t i, c;
+
+    if (!g_forkscan_slab) return;
+
+    // Reserve the arena, inaccessible, so it costs nothing to scan or fork
+    // until it is used.  Slabs are aligned so headers can be found by
+    // shifting.
+    char *p = mmap(NULL, SLAB_ARENA_SIZE + SLAB_SIZE, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == p) {
+        forkscan_diagnostic("unable to reserve the slab arena.\n");
+        return;
+    }
+    g_slab_base = ((size_t)p + SLAB_SIZE - 1) & ~(SLAB_SIZE - 1);
+
+    g_slab_meta = (slab_meta_t*)
+        forkscan_alloc_mmap(N_SLABS * sizeof(slab_meta_t), "slab meta");
+    // Shared, so marks made by sibling scanners are seen by all.
+    g_slab_candidates = (size_t*)
+        forkscan_alloc_mmap_shared(N_GRANULES / 8, "slab candidates");
+    g_slab_marks = (size_t*)
+        forkscan_alloc_mmap_shared(N_GRANULES / 8, "slab marks");
+
+    for (c = 0, i = 0; i < sizeof(g_class_of); ++i) {
+        if ((i << SLAB_GRANULE_SHIFT) > g_class_sizes[c]) ++c;
+        g_class_of[i] = c;
+    }
+    for (c = 0; c < N_CLASSES; ++c) {
+        pthread_mutex_init(&g_classes[c].lock, NULL);
+        g_classes[c].obj_size = g_class_sizes[c];
+    }
+
+    g_slab_span = SLAB_ARENA_SIZE;
+}
@@ -0,0 +1,107 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Module Description:
+   Optional size-class slab allocator behind forkscan_malloc()
+   (FORKSCAN_SLAB=1).  Slabs are carved out of one reserved arena, and the
+   per-slab metadata lives off to the side, indexed by slab number, so the
+   size and start of any object in the arena are found in O(1).  A pair of
+   bitmaps (one bit per granule) records which objects are candidates in
+   the current iteration and which have been marked, replacing the binary
+   search through the sorted address list.
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+
+#define SLAB_SHIFT 16
+#define SLAB_SIZE ((size_t)1 << SLAB_SHIFT)
+#define SLAB_ARENA_SIZE ((size_t)4 << 30)
+#define SLAB_GRANULE_SHIFT 4
+#define SLAB_MAX_OBJECT 2048
+
+typedef struct slab_meta_t slab_meta_t;
+
+/** Header for a slab, kept outside the arena.
+ */
+struct slab_meta_t {
+    unsigned int obj_size;
+    unsigned int size_class;
+};
+
+extern size_t g_slab_base;        // Start of the arena.
+extern size_t g_slab_span;        // Arena size, or zero if inactive.
+extern slab_meta_t *g_slab_meta;  // Per-slab headers.
+extern size_t *g_slab_candidates; // One bit per granule: is a candidate.
+extern size_t *g_slab_marks;      // One bit per granule: has been marked.
+
+/**
+ * Return nonzero if addr is in the slab arena.
+ */
+static inline int forkscan_slab_owns (size_t addr)
+{
+    return addr - g_slab_base < g_slab_span;
+}
+
+/**
+ * Size of the object at addr, which must be in the arena.
+ */
+static inline size_t forkscan_slab_usable_size (size_t addr)
+{
+    return g_slab_meta[(addr - g_slab_base) >> SLAB_SHIFT].obj_size;
+}
+
+/**
+ * Allocate from the slab arena.  Return NULL if size is too big or the
+ * arena is exhausted.
+ */
+void *forkscan_slab_alloc (size_t size);
+
+/**
+ * Return an object to its slab.
+ */
+void forkscan_slab_free (void *ptr);
+
+/****************************************************************************/
+/*                   Candidate and mark bits (the child).                   */
+/****************************************************************************/
+
+/**
+ * Flag the arena objects in addrs as candidates.
+ */
+void forkscan_slab_set_candidates (size_t *addrs, int n);
+
+/**
+ * Mark addr if it is a candidate.  Return 1 if this call did the marking,
+ * zero if it isn't a candidate or was already marked.
+ */
+int forkscan_slab_mark (size_t addr);
+
+/**
+ * Copy the marks into the low bit of addrs and clear the candidate and mark
+ * bits for the next iteration.
+ */
+void forkscan_slab_collect_marks (size_t *addrs, int n);
+
+#endif // !defined _SLAB_H_
@@ -20,6 +20,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#include "thread.h"
 #include <time.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -38,11 +39,14 @@ void forkscan_usleep (unsigned long long usec)
     begin_us = current_us;
     end_us = begin_us + usec;
 
+    // Snapshots skip sleeping threads, so this is seldom interrupted.
+    forkscan_thread_enter_blocking();
     while (current_us < end_us) {
         usleep(end_us - current_us);
         clock_gettime(CLOCK_MONOTONIC, &ts);
         current_us = (ts.tv_sec * 1000 * 1000) + (ts.tv_nsec / 1000);
     }
+    forkscan_thread_exit_blocking();
 }
 
 /**
@@ -0,0 +1,117 @@
+/* Benchmark for FORKSCAN_ZERO, the policy for clearing reclaimed blocks.
+   Build against the library and run with no arguments:
+
+     gcc -O2 -o zeroing zeroing.c -lforkscan -pthread
+     ./zeroing
+
+   It runs itself once per policy and reports, for each block size, the
+   cost of a steady allocate/fill/retire churn.  Freeing (and clearing) is
+   paid for on the retiring threads, so it shows up in ns/retire.
+ */
+
+#include <forkscan.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define N_THREADS 4
+#define BYTES_PER_SIZE (256UL * 1024 * 1024) // Retired per thread, per size.
+
+static const char *modes[] = { "full", "none", "pointers", "nontemporal",
+                               "madvise" };
+static const size_t sizes[] = { 64, 1024, 16 * 1024, 128 * 1024 };
+
+static size_t g_size;
+
+static double now ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *churn (void *ignored)
+{
+    size_t n = BYTES_PER_SIZE / g_size;
+    size_t i, j;
+    void *prev = NULL;
+
+    for (i = 0; i < n; ++i) {
+        void **block = forkscan_malloc(g_size);
+        // Half pointers, half data: what a typical node looks like.
+        for (j = 0; j < g_size / sizeof(void*); ++j) {
+            block[j] = j & 1 ? (void*)j : prev;
+        }
+        // Short chains, so the collector has some (dead) pointers to chase.
+        prev = i % 16 ? block : NULL;
+        forkscan_retire(block);
+    }
+    return NULL;
+}
+
+static long rss_kb ()
+{
+    long pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (1 != fscanf(fp, "%*ld %ld", &pages)) pages = 0;
+        fclose(fp);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void run_mode (const char *mode)
+{
+    pthread_t tid[N_THREADS];
+    size_t s;
+    int i;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        double start, elapsed;
+        size_t retires;
+
+        g_size = sizes[s];
+        retires = N_THREADS * (BYTES_PER_SIZE / g_size);
+        start = now();
+        for (i = 0; i < N_THREADS; ++i) {
+            pthread_create(&tid[i], NULL, churn, NULL);
+        }
+        for (i = 0; i < N_THREADS; ++i) pthread_join(tid[i], NULL);
+        elapsed = now() - start;
+
+        printf("%-12s %7zu B  %8.1f ns/retire  %6.2f GB/s  rss %ld KB\n",
+               mode, g_size, elapsed * 1e9 / retires,
+               retires * g_size / elapsed / 1e9, rss_kb());
+        fflush(stdout);
+    }
+}
+
+int main (int argc, char **argv)
+{
+    int m;
+
+    if (argc > 1) {
+        run_mode(argv[1]);
+        return 0;
+    }
+
+    // FORKSCAN_ZERO is read at load time, so each policy gets a fresh run.
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+        pid_t pid = fork();
+        if (0 == pid) {
+            char policy[8];
+            snprintf(policy, sizeof(policy), "%d", m);
+            setenv("FORKSCAN_ZERO", policy, 1);
+            execl("/proc/self/exe", argv[0], modes[m], (char*)NULL);
+            perror("execl");
+            exit(1);
+        }
+        waitpid(pid, NULL, 0);
+    }
+
+    return 0;
+}
@@ -23,12 +23,16 @@ THE SOFTWARE.
 #include "alloc.h"
 #include <alloca.h>
 #include <assert.h>
+#include <errno.h>
+#include "forkscan.h"
 #include "proc.h"
 #include <pthread.h>
 #include <setjmp.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include "thread.h"
+#include <unistd.h>
 #include "util.h"
 
 /**
@@ -71,12 +75,14 @@ void *forkscan_thread_base (void *arg)
 
     // Put the thread metadata into TLS.
     forkscan_local_td = td;
+    forkscan_util_thread_data_localize(td);
 
     // Counter for getting consensus during cleanup.
     td->local_timestamp = 0;
 
     // Save info about this thread so that it can be signalled for cleanup.
     td->self = pthread_self();
+    td->tid = (pid_t)syscall(SYS_gettid);
     td->is_active = 1;
 
     // Call the user thread.  Exit with the return code when complete.
@@ -99,11 +105,58 @@ void forkscan_thread_cleanup ()
     assert(td);
     td->is_active = 0;
     forkscan_proc_remove_thread_data(td);
+    forkscan_util_finish_free(td);
     extern size_t g_total_wait_time_ms; // FIXME: Bad, bad, bad!
     __sync_fetch_and_add(&g_total_wait_time_ms, td->wait_time_ms);
     forkscan_util_thread_data_decr_ref(td);
 }
 
+/**
+ * Leave this thread out of snapshots until forkscan_thread_exit_blocking().
+ */
+void forkscan_thread_enter_blocking ()
+{
+    thread_data_t *td = forkscan_local_td;
+    if (NULL == td) return;
+    if (td->blocking > 0) {
+        ++td->blocking;
+        return;
+    }
+
+    // Pointers the caller only has in registers must stay visible to the
+    // scan.  The caller-saved ones are dead across this call anyway.  They
+    // have to be in place before the GC thread can see we're blocking.
+    __asm__ volatile ("movq %%rbx, 0(%0)\n\t"
+                      "movq %%rbp, 8(%0)\n\t"
+                      "movq %%r12, 16(%0)\n\t"
+                      "movq %%r13, 24(%0)\n\t"
+                      "movq %%r14, 32(%0)\n\t"
+                      "movq %%r15, 40(%0)\n\t"
+                      : : "r" (td->blocking_regs) : "memory");
+    __sync_synchronize();
+    td->blocking = 1;
+    __sync_synchronize();
+}
+
+/**
+ * Rejoin snapshots after forkscan_thread_enter_blocking(), waiting out
+ * one that is being taken.
+ */
+void forkscan_thread_exit_blocking ()
+{
+    thread_data_t *td = forkscan_local_td;
+    int saved_errno = errno; // Callers check it after their blocking call.
+    if (NULL == td) return;
+    assert(td->blocking > 0);
+    if (--td->blocking > 0) return;
+
+    // Either the GC thread sees this thread is back and stops it with the
+    // others, or this thread sees the snapshot and stops on its own.
+    __sync_synchronize();
+    forkscan_wait_for_snapshot();
+    errno = saved_errno;
+}
+
 /**
  * Send the given signal to all threads in the process and return the number
  * of signals sent.
@@ -24,6 +24,7 @@ THE SOFTWARE.
 #define _THREAD_H_
 
 #include "alloc.h"
+#include "util.h"
 
 /**
  * Return the local metadata for this thread.
@@ -43,6 +44,18 @@ void *forkscan_thread_base (void *arg);
  */
 void forkscan_thread_cleanup ();
 
+/**
+ * Leave this thread out of snapshots until forkscan_thread_exit_blocking().
+ * Calls may nest.
+ */
+void forkscan_thread_enter_blocking ();
+
+/**
+ * Rejoin snapshots after forkscan_thread_enter_blocking(), waiting out
+ * one that is being taken.
+ */
+void forkscan_thread_exit_blocking ();
+
 /**
  * Send the given signal to all threads in the process and return the number
  * of signals sent.
@@ -0,0 +1,236 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "child.h"
+#include "env.h"
+#include "proc.h"
+#include <stdio.h>
+#include <unistd.h>
+#include "tune.h"
+#include "util.h"
+
+// Weight of a new sample in the running averages, out of 1.
+#define SMOOTHING 0.25
+
+// Floor on the queue limit, so a thread isn't forking for every retire.
+#define MIN_QUEUE_LIMIT 256
+
+/****************************************************************************/
+/*                                 Globals                                  */
+/****************************************************************************/
+
+volatile size_t g_forkscan_queue_limit;
+
+// Ceilings, from the environment or forkscan_set_param().  Children past
+// the CPU count only slow the scan down.
+static size_t g_max_queue_limit;
+static int g_max_throttling_queue;
+static int g_max_children;
+
+// Cost model, as running averages: the pause per cycle, the scan's CPU
+// time per byte and the retire rate (per ns).
+static double g_pause_ns;
+static double g_scan_ns_per_byte;
+static double g_retires_per_ns;
+static size_t g_last_ns;
+
+static size_t g_retunes;
+
+/****************************************************************************/
+/*                                 Helpers                                  */
+/****************************************************************************/
+
+static double smooth (double avg, double sample)
+{
+    return avg ? avg + SMOOTHING * (sample - avg) : sample;
+}
+
+static size_t clamp (double val, size_t low, size_t high)
+{
+    if (val <= (double)low) return low;
+    if (val >= (double)high) return high;
+    return (size_t)val;
+}
+
+/**
+ * Apply the queue limit to every thread's queue.  New threads pick it up
+ * when they're created.
+ */
+static void set_queue_limit (size_t limit)
+{
+    thread_list_t *thread_list = forkscan_proc_get_thread_list();
+    thread_data_t *td;
+
+    g_forkscan_queue_limit = limit;
+    FOREACH_IN_THREAD_LIST(td, thread_list)
+        forkscan_queue_set_limit(&td->ptr_list, limit);
+    ENDFOREACH_IN_THREAD_LIST(td, thread_list);
+}
+
+static int thread_count ()
+{
+    thread_list_t *thread_list = forkscan_proc_get_thread_list();
+    thread_data_t *td;
+    int n = 0;
+
+    FOREACH_IN_THREAD_LIST(td, thread_list)
+        ++n;
+    ENDFOREACH_IN_THREAD_LIST(td, thread_list);
+    return MAX_OF(n, 1);
+}
+
+/**
+ * Work out new settings from the cost model.
+ *
+ * A cycle costs every thread the pause, plus the scan's CPU time, which
+ * grows with the heap rather than the batch.  At the current retire rate,
+ * the batch that keeps that under FORKSCAN_TUNE_OVERHEAD percent of a CPU
+ * is rate * cost / goal.  Bigger batches cost less per retire but hold
+ * more garbage, so that's the batch, unless there is a memory target:
+ * then garbage is already bounded by bytes, and batches may as well be
+ * as big as the queues allow.  The scan gets as many children as it takes
+ * to finish before the next batch fills, and collects may queue up for as
+ * many batches as fill during one cycle.
+ */
+static void retune (size_t bytes_scanned)
+{
+    int n_threads = thread_count();
+    size_t max_limit = g_max_queue_limit;
+    double goal = g_forkscan_tune_overhead / 100.0;
+    double scan_cpu_ns = g_scan_ns_per_byte * bytes_scanned;
+    double cycle_ns = g_pause_ns * n_threads + scan_cpu_ns;
+    double batch, fill_ns, wall_ns;
+    size_t limit;
+    int children, depth;
+
+    if (g_forkscan_memory_target) {
+        limit = max_limit;
+    } else {
+        batch = g_retires_per_ns * cycle_ns / goal;
+        limit = clamp(batch / n_threads, MIN_QUEUE_LIMIT, max_limit);
+    }
+    fill_ns = limit * n_threads / g_retires_per_ns;
+
+    if (fill_ns <= g_pause_ns) children = g_max_children;
+    else children = clamp(scan_cpu_ns / (fill_ns - g_pause_ns) + 1, 1,
+                          g_max_children);
+    wall_ns = g_pause_ns + scan_cpu_ns / children;
+
+    if (forkscan_util_over_memory_limit()) depth = 1;
+    else depth = clamp(wall_ns / fill_ns + 1, 1, g_max_throttling_queue);
+
+    if (limit != g_forkscan_queue_limit
+        || children != g_forkscan_max_children
+        || depth != g_forkscan_throttling_queue) {
+        ++g_retunes;
+    }
+    set_queue_limit(limit);
+    g_forkscan_max_children = children;
+    g_forkscan_throttling_queue = depth;
+}
+
+__attribute__((constructor (201)))
+static void tune_init ()
+{
+    g_forkscan_queue_limit = g_forkscan_ptrs_per_thread;
+    g_max_queue_limit = g_forkscan_queue_limit;
+    forkscan_tune_throttling_queue_set();
+    forkscan_tune_max_children_set();
+}
+
+/****************************************************************************/
+/*                            Exported functions                            */
+/****************************************************************************/
+
+/**
+ * Account for an iteration that reclaimed from n_retired new pointers: its
+ * threads were stopped for pause_ns, and it took scan_ns more to scan
+ * bytes_scanned.  Retune if FORKSCAN_AUTOTUNE is set.
+ */
+void forkscan_tune_iteration (size_t n_retired, size_t pause_ns,
+                              size_t scan_ns, size_t bytes_scanned)
+{
+    size_t now = forkscan_util_ns();
+    size_t last = g_last_ns;
+
+    if (!g_forkscan_autotune) return;
+    g_last_ns = now;
+
+    g_pause_ns = smooth(g_pause_ns, pause_ns);
+    if (bytes_scanned) {
+        // The scan's wall time, times the children that shared it.
+        int children = MIN_OF(forkscan_child_count(bytes_scanned),
+                              g_max_children);
+        g_scan_ns_per_byte = smooth(g_scan_ns_per_byte,
+                                    (double)scan_ns * children
+                                    / bytes_scanned);
+    }
+    // The first iteration has no interval to measure the rate over.
+    if (0 == last || now <= last || 0 == n_retired) return;
+    g_retires_per_ns = smooth(g_retires_per_ns,
+                              (double)n_retired / (now - last));
+    retune(bytes_scanned);
+}
+
+/**
+ * g_forkscan_queue_limit was set: apply it to every thread, and make it
+ * the tuner's ceiling.
+ */
+void forkscan_tune_queue_limit_set ()
+{
+    g_max_queue_limit = MIN_OF(g_forkscan_queue_limit,
+                               (size_t)g_forkscan_ptrs_per_thread);
+    set_queue_limit(g_max_queue_limit);
+}
+
+/**
+ * g_forkscan_throttling_queue was set: make it the tuner's ceiling.
+ */
+void forkscan_tune_throttling_queue_set ()
+{
+    g_max_throttling_queue = g_forkscan_throttling_queue;
+}
+
+/**
+ * g_forkscan_max_children was set: make it the tuner's ceiling.
+ */
+void forkscan_tune_max_children_set ()
+{
+    g_max_children = MIN_OF(g_forkscan_max_children,
+                            sysconf(_SC_NPROCESSORS_ONLN));
+    g_max_children = MAX_OF(g_max_children, 1);
+}
+
+/**
+ * Print the tuner's current settings to stdout.
+ */
+void forkscan_tune_print_statistics ()
+{
+    if (!g_forkscan_autotune) return;
+    printf("tune-retunes: %zu\n", g_retunes);
+    printf("tune-queue-limit: %zu\n", g_forkscan_queue_limit);
+    printf("tune-throttling-queue: %d\n", g_forkscan_throttling_queue);
+    printf("tune-max-children: %d\n", g_forkscan_max_children);
+    printf("tune-pause-us: %.1f\n", g_pause_ns / 1000);
+    printf("tune-scan-ns-per-kb: %.1f\n", g_scan_ns_per_byte * 1024);
+    printf("tune-retires-per-ms: %.1f\n", g_retires_per_ns * 1000000);
+}
@@ -0,0 +1,68 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Module Description:
+   Online tuning (FORKSCAN_AUTOTUNE).  After every iteration, the GC thread
+   reports what it cost: the stop-the-world pause (handshake and fork), the
+   scan and how much it covered.  With the retire rate and outstanding
+   garbage, that gives a cost model for a cycle, and from it the tuner sets
+   how many pointers a thread's queue holds before an iteration, how many
+   collects may queue up before threads are throttled, and how many
+   children share a scan.  The environment's settings become ceilings.
+ */
+
+#ifndef _TUNE_H_
+#define _TUNE_H_
+
+#include <stddef.h>
+
+// Pointers a thread's queue may hold before it starts an iteration.  Up to
+// FORKSCAN_PTRS_PER_THREAD.
+extern volatile size_t g_forkscan_queue_limit;
+
+/**
+ * Account for an iteration that reclaimed from n_retired new pointers: its
+ * threads were stopped for pause_ns, and it took scan_ns more to scan
+ * bytes_scanned.  Retune if FORKSCAN_AUTOTUNE is set.
+ */
+void forkscan_tune_iteration (size_t n_retired, size_t pause_ns,
+                              size_t scan_ns, size_t bytes_scanned);
+
+/**
+ * g_forkscan_queue_limit was set: apply it to every thread, and make it
+ * the tuner's ceiling.
+ */
+void forkscan_tune_queue_limit_set ();
+
+/**
+ * g_forkscan_throttling_queue or g_forkscan_max_children was set: make it
+ * the tuner's ceiling.
+ */
+void forkscan_tune_throttling_queue_set ();
+void forkscan_tune_max_children_set ();
+
+/**
+ * Print the tuner's current settings to stdout.
+ */
+void forkscan_tune_print_statistics ();
+
+#endif // !defined _TUNE_H_
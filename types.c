@@ -0,0 +1,63 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "alloc.h"
+#include <pthread.h>
+#include "types.h"
+
+type_info_t *g_types;
+static int g_n_types;
+static pthread_mutex_t g_types_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Register an object layout.
+ * @return The new type ID, or -1 if the registry is full.
+ */
+int forkscan_types_register (size_t size, unsigned long long ptr_map)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&g_types_lock);
+    if (NULL == g_types) {
+        // Off to the side, where the scan won't look at it.  Pages are only
+        // touched as types are added.
+        g_types = (type_info_t*)
+            forkscan_alloc_mmap((MAX_TYPES + 1) * sizeof(type_info_t),
+                                "type registry");
+    }
+    if (g_n_types < MAX_TYPES) {
+        ret = ++g_n_types;
+        g_types[ret].size = size;
+        g_types[ret].ptr_map = ptr_map;
+    }
+    pthread_mutex_unlock(&g_types_lock);
+
+    return ret;
+}
+
+/**
+ * Return the number of types registered.  IDs run from 1 to this.
+ */
+int forkscan_types_count ()
+{
+    return g_n_types;
+}
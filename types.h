@@ -0,0 +1,68 @@
+/*
+Copyright (c) 2018 Forkscan authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Module Description:
+   Registry of object layouts.  An object retired with a type is traced
+   precisely: only the words its pointer map names are followed, and an
+   object with an empty map isn't traced at all.
+ */
+
+#ifndef _TYPES_H_
+#define _TYPES_H_
+
+#include <stddef.h>
+
+// Type IDs must fit in 15 bits; zero means "no type".
+#define MAX_TYPES 0x7FFF
+
+// Words in a pointer map.  Past that, an object is traced conservatively.
+#define TYPE_MAP_WORDS 64
+
+typedef struct type_info_t type_info_t;
+
+struct type_info_t {
+    size_t size;                 // Object size in bytes.
+    unsigned long long ptr_map;  // Bit i: word i may hold a pointer.
+};
+
+extern type_info_t *g_types;
+
+/**
+ * Register an object layout.
+ * @return The new type ID, or -1 if the registry is full.
+ */
+int forkscan_types_register (size_t size, unsigned long long ptr_map);
+
+/**
+ * Return the number of types registered.  IDs run from 1 to this.
+ */
+int forkscan_types_count ();
+
+/**
+ * Return the layout for a type ID handed out by forkscan_types_register().
+ */
+static inline type_info_t *forkscan_types_get (int type_id)
+{
+    return &g_types[type_id];
+}
+
+#endif // !defined _TYPES_H_
@@ -20,16 +20,22 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#define _GNU_SOURCE // For sched_getcpu().
 #include <assert.h>
 #include "alloc.h"
+#include <emmintrin.h>
 #include "env.h"
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
+#include "tune.h"
+#include "types.h"
 #include "util.h"
 
 /****************************************************************************/
@@ -39,23 +45,72 @@ THE SOFTWARE.
 // Size of a per-thread metadata memory block.
 #define MEMBLOCK_SIZE PAGESIZE
 
-#define FREE_RANGE_SZ 1024
+// How many pointers to go through between looks at the clock.
+#define PACE_CHECK_INTERVAL 4
+
+// Retired bytes a thread counts up before adding them to the totals.
+#define RETIRED_FLUSH_BYTES (64 * 1024)
+
+// Retirers are throttled once outstanding garbage reaches this multiple of
+// the memory target.
+#define MEMORY_HARD_FACTOR 2
+
+// Most blocks handed to the allocator's free hooks at once.
+#define FREE_BATCH_SZ 64
+
+// Smaller blocks are memset() even under ZERO_NONTEMPORAL.
+#define NONTEMPORAL_MIN_SZ 1024
+
+// Words in this range might be pointers into the heap.  Like the scanner,
+// allow for tags in the low bits (e.g., marked next pointers).
+#define MAYBE_POINTER(v) (PTR_MASK(v) >= PAGESIZE                \
+                          && PTR_MASK(v) < ((size_t)1 << 47))
+
+// Most full magazines kept per size class for threads to trade.  Beyond
+// that, blocks go back to the allocator.
+#define MAGAZINE_DEPOT_MAX 16
+
+typedef struct free_batch_t free_batch_t;
 
 typedef struct free_list_node_t free_list_node_t;
 
+// Reclaimed blocks on their way back to the allocator, in address order.
+struct free_batch_t
+{
+    int n_ptrs;
+    void *ptrs[FREE_BATCH_SZ];
+    unsigned int sizes[FREE_BATCH_SZ];
+};
+
 struct free_list_node_t
 {
     free_list_node_t *next;
     free_t *free_list;
+    int count;
 };
 
-static free_list_node_t *free_list_list;
+static free_list_node_t *free_list_list[MAGAZINE_CLASSES];
+static int free_list_count[MAGAZINE_CLASSES];
 static pthread_mutex_t free_list_list_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // FIXME: Are these actually used?
 static pthread_mutex_t g_staged_lock = PTHREAD_MUTEX_INITIALIZER;
 static thread_data_t *g_td_staged_to_free = NULL;
 
+static void magazines_flush (thread_data_t *td);
+
+// Free pacing: dead pointers handed out but not yet free'd,
+// the (smoothed) number of pointers retired per iteration, and the
+// (smoothed) cost of getting through one of them.
+static volatile long g_dead_backlog;
+static volatile size_t g_retires_per_iteration = 1;
+static volatile size_t g_ns_per_free = 100;
+
+// Memory pacing, when there's a target: bytes retired but not yet free'd,
+// and bytes retired since the last reclaimer gathered up the queues.
+static volatile long g_outstanding_bytes;
+static volatile long g_unscanned_bytes;
+
 /****************************************************************************/
 /*                       Storage for per-thread data.                       */
 /****************************************************************************/
@@ -66,7 +121,7 @@ static thread_data_t *g_td_staged_to_free = NULL;
 // pages.
 DEFINE_POOL_ALLOC(threaddata, MEMBLOCK_SIZE, 8, forkscan_alloc_mmap_shared)
 DEFINE_POOL_ALLOC(ptrlist, (g_forkscan_ptrs_per_thread * sizeof(size_t)), 8,
-                  forkscan_alloc_mmap_shared)
+                  forkscan_alloc_mmap_shared_huge)
 
 thread_data_t *forkscan_util_thread_data_new ()
 {
@@ -74,12 +129,40 @@ thread_data_t *forkscan_util_thread_data_new ()
     size_t *local_list = (size_t*)pool_alloc_ptrlist();
     forkscan_queue_init(&td->ptr_list, local_list,
                         g_forkscan_ptrs_per_thread);
+    forkscan_queue_set_limit(&td->ptr_list, g_forkscan_queue_limit);
     td->local_block.low = td->local_block.high = 0;
     td->ref_count = 1;
     td->retiree_buffer = NULL;
+    td->spill = NULL;
+    td->helps_free = -1;
+    td->retired_bytes = 0;
+    td->blocking = 0;
+    td->node = 0;
+    memset(td->numa_out, 0, sizeof(td->numa_out));
+    memset(td->magazines, 0, sizeof(td->magazines));
     return td;
 }
 
+void forkscan_util_thread_data_localize (thread_data_t *td)
+{
+    static int reported;
+    int failed;
+
+    if (!forkscan_numa_active()) return;
+    td->node = forkscan_numa_current_node();
+    failed = forkscan_numa_bind_local(td, MEMBLOCK_SIZE);
+    // Pointer lists are carved out of a shared mapping, and if that has
+    // hugetlb pages (FORKSCAN_HUGE_PAGES=2), a piece can't be bound on its
+    // own.  Such a list stays where it is.
+    failed |= forkscan_numa_bind_local(td->ptr_list.e,
+                                       g_forkscan_ptrs_per_thread
+                                       * sizeof(size_t));
+    if (failed && BCAS(&reported, 0, 1)) {
+        forkscan_diagnostic("Unable to bind thread data to NUMA node %d: "
+                            "%s.\n", td->node, strerror(errno));
+    }
+}
+
 void forkscan_util_thread_data_decr_ref (thread_data_t *td)
 {
     if (0 == __sync_fetch_and_sub(&td->ref_count, 1) - 1) {
@@ -94,26 +177,35 @@ void forkscan_util_thread_data_free (thread_data_t *td)
 {
     assert(td);
     assert(td->ref_count == 0);
+    assert(NULL == td->retiree_buffer);
 
     // FIXME: Should do something about any possible remaining pointers in this
     // thread's ptr_list!  Right now, they're getting leaked.
     pool_free_ptrlist(td->ptr_list.e);
+    forkscan_buffer_spill_flush(&td->spill);
+    magazines_flush(td);
 
     pool_free_threaddata(td);
 }
 
-void forkscan_util_thread_data_cleanup (pthread_t tid)
+thread_data_t *forkscan_util_thread_data_unstage (pthread_t tid)
 {
-    thread_data_t *td, *last = NULL;
+    thread_data_t *td, *last;
 
-    // Find the thread data and remove it from the list.
-    pthread_mutex_lock(&g_staged_lock);
-    td = g_td_staged_to_free;
-    assert(td);
-    while (0 == pthread_equal(td->self, tid)) {
-        last = td;
-        td = td->next;
-        assert(td);
+    // Find the thread data and remove it from the list.  The GC thread
+    // may still be holding a reference from a snapshot handshake, in which
+    // case the thread data shows up once it lets go.
+    for (;;) {
+        pthread_mutex_lock(&g_staged_lock);
+        last = NULL;
+        td = g_td_staged_to_free;
+        while (td && 0 == pthread_equal(td->self, tid)) {
+            last = td;
+            td = td->next;
+        }
+        if (td) break;
+        pthread_mutex_unlock(&g_staged_lock);
+        sched_yield();
     }
     if (last) {
         last->next = td->next;
@@ -122,6 +214,11 @@ void forkscan_util_thread_data_cleanup (pthread_t tid)
     }
     pthread_mutex_unlock(&g_staged_lock);
 
+    return td;
+}
+
+void forkscan_util_thread_data_cleanup (thread_data_t *td)
+{
     if (td->ref_count > 0) {
         forkscan_fatal("Forkscan: "
                        "detected data race on exiting thread.\n");
@@ -192,81 +289,559 @@ thread_data_t *forkscan_util_thread_list_find (thread_list_t *tl, size_t addr)
     return ret;
 }
 
-void forkscan_util_push_free_list (free_t *free_list)
+/**
+ * Hand a block back to whichever allocator it came from.
+ */
+static void release_block (void *ptr)
+{
+    if (forkscan_slab_owns((size_t)ptr)) forkscan_slab_free(ptr);
+    else FREE(ptr);
+}
+
+/**
+ * Offer a list of count free blocks of size class cls to other threads.
+ * If the depot already holds enough lists of that class, the blocks are
+ * returned to the allocator instead.
+ */
+void forkscan_util_push_free_list (int cls, free_t *free_list, int count)
 {
     // FIXME: We should really do this add/remove stuff with transactions.
-    free_list_node_t *node = MALLOC(sizeof(free_list_node_t));
-    pthread_mutex_lock(&free_list_list_lock);
-    node->free_list = free_list;
-    node->next = free_list_list;
-    free_list_list = node;
-    pthread_mutex_unlock(&free_list_list_lock);
+    free_list_node_t *node = NULL;
+    assert(cls > 0 && cls < MAGAZINE_CLASSES);
+    if (free_list_count[cls] < MAGAZINE_DEPOT_MAX) {
+        node = MALLOC(sizeof(free_list_node_t));
+        node->free_list = free_list;
+        node->count = count;
+        pthread_mutex_lock(&free_list_list_lock);
+        if (free_list_count[cls] < MAGAZINE_DEPOT_MAX) {
+            node->next = free_list_list[cls];
+            free_list_list[cls] = node;
+            ++free_list_count[cls];
+            free_list = NULL;
+        }
+        pthread_mutex_unlock(&free_list_list_lock);
+    }
+    if (NULL == free_list) return;
+
+    if (node) FREE(node);
+    while (free_list) {
+        free_t *next = free_list->next;
+        release_block(free_list);
+        free_list = next;
+    }
+}
+
+/**
+ * Hand every block in the depot back to the allocator.
+ */
+void forkscan_util_trim ()
+{
+    int cls, count;
+    for (cls = 1; cls < MAGAZINE_CLASSES; ++cls) {
+        free_t *free_list;
+        while ((free_list = forkscan_util_pop_free_list(cls, &count))) {
+            while (free_list) {
+                free_t *next = free_list->next;
+                release_block(free_list);
+                free_list = next;
+            }
+        }
+    }
 }
 
-free_t *forkscan_util_pop_free_list ()
+/**
+ * Take a list of free blocks of size class cls from the depot, or NULL if
+ * there are none.  The length of the list is stored in count.
+ */
+free_t *forkscan_util_pop_free_list (int cls, int *count)
 {
     // FIXME: We should really do this add/remove stuff with transactions.
     free_list_node_t *node;
     free_t *free_list = NULL;
-    if (free_list_list == NULL) return NULL;
+    assert(cls > 0 && cls < MAGAZINE_CLASSES);
+    if (free_list_list[cls] == NULL) return NULL;
     pthread_mutex_lock(&free_list_list_lock);
-    node = free_list_list;
-    if (node != NULL) free_list_list = node->next;
+    node = free_list_list[cls];
+    if (node != NULL) {
+        free_list_list[cls] = node->next;
+        --free_list_count[cls];
+    }
     pthread_mutex_unlock(&free_list_list_lock);
     if (node) {
         free_list = node->free_list;
+        *count = node->count;
         FREE(node);
     }
     return free_list;
 }
 
-void forkscan_util_free_ptrs (thread_data_t *td)
+/**
+ * Cache a reclaimed block of the given size in td's magazines.  A full
+ * magazine is traded in to the depot first.  Returns 0 if the block does
+ * not fit a size class and must be released by the caller.
+ */
+static int magazine_put (thread_data_t *td, void *ptr, size_t size)
+{
+    size_t cls = MAGAZINE_PUT_CLASS(size);
+    magazine_t *mag;
+
+    if (0 == cls || cls >= MAGAZINE_CLASSES) return 0;
+    mag = &td->magazines[cls];
+    if (mag->count >= g_forkscan_magazine_size) {
+        forkscan_util_push_free_list(cls, mag->head, mag->count);
+        mag->head = NULL;
+        mag->count = 0;
+    }
+    ((free_t*)ptr)->next = mag->head;
+    mag->head = (free_t*)ptr;
+    ++mag->count;
+    return 1;
+}
+
+/**
+ * Return a cached block of at least size bytes from td's magazines,
+ * refilling from the depot if need be, or NULL if there is none.
+ */
+void *forkscan_util_magazine_get (thread_data_t *td, size_t size)
+{
+    size_t cls = MAGAZINE_GET_CLASS(size);
+    magazine_t *mag;
+    free_t *block;
+
+    if (0 == cls) cls = 1;
+    if (cls >= MAGAZINE_CLASSES) return NULL;
+    mag = &td->magazines[cls];
+    if (NULL == mag->head) {
+        mag->head = forkscan_util_pop_free_list(cls, &mag->count);
+        if (NULL == mag->head) return NULL;
+    }
+    block = mag->head;
+    mag->head = block->next;
+    --mag->count;
+    block->next = NULL;
+    return block;
+}
+
+/**
+ * Give td's cached blocks to the depot when the thread goes away.
+ */
+static void magazines_flush (thread_data_t *td)
+{
+    int cls;
+    for (cls = 1; cls < MAGAZINE_CLASSES; ++cls) {
+        magazine_t *mag = &td->magazines[cls];
+        if (mag->head) forkscan_util_push_free_list(cls, mag->head,
+                                                    mag->count);
+        mag->head = NULL;
+        mag->count = 0;
+    }
+}
+
+/**
+ * Clear a reclaimed block according to FORKSCAN_ZERO, so whatever stale
+ * pointers it held can't hold other objects alive in later scans.
+ */
+static void scrub_block (void *ptr, size_t size)
+{
+    switch (g_forkscan_zero) {
+    case ZERO_NONE:
+        return;
+
+    case ZERO_POINTERS: {
+        size_t *words = (size_t*)ptr;
+        size_t i, n = size / sizeof(size_t);
+        // Reading is cheaper than dirtying every line.
+        for (i = 0; i < n; ++i) {
+            if (MAYBE_POINTER(words[i])) words[i] = 0;
+        }
+        return;
+    }
+
+    case ZERO_NONTEMPORAL: {
+        size_t low = (size_t)ptr, high = low + size;
+        size_t a_low = (low + 15) & ~(size_t)15, a_high = high & ~(size_t)15;
+        if (size < NONTEMPORAL_MIN_SZ) break;
+        __m128i zero = _mm_setzero_si128();
+        memset(ptr, 0x0, a_low - low);
+        for (; a_low < a_high; a_low += 16) {
+            _mm_stream_si128((__m128i*)a_low, zero);
+        }
+        memset((void*)a_high, 0x0, high - a_high);
+        // The block may be handed out again right away.
+        _mm_sfence();
+        return;
+    }
+
+    case ZERO_MADVISE: {
+        size_t low = (size_t)ptr, high = low + size;
+        size_t p_low = PAGEALIGN(low + PAGESIZE - 1), p_high = PAGEALIGN(high);
+        if (p_low >= p_high) break;
+        memset(ptr, 0x0, p_low - low);
+        // Private anonymous pages read back as zeros.
+        if (0 != madvise((void*)p_low, p_high - p_low, MADV_DONTNEED)) {
+            memset((void*)p_low, 0x0, p_high - p_low);
+        }
+        memset((void*)p_high, 0x0, high - p_high);
+        return;
+    }
+    }
+
+    memset(ptr, 0x0, size);
+}
+
+/**
+ * Return a batch of reclaimed blocks, in address order, to the allocator
+ * through the fastest hook it registered.
+ */
+static void release_batch (free_batch_t *fb)
 {
     int i;
 
-    assert(td);
+    if (0 == fb->n_ptrs) return;
+    if (__forkscan_free_batch) {
+        __forkscan_free_batch(fb->ptrs, fb->n_ptrs);
+    } else {
+        for (i = 0; i < fb->n_ptrs; ++i) FREE_SIZED(fb->ptrs[i], fb->sizes[i]);
+    }
+    fb->n_ptrs = 0;
+}
+
+/**
+ * Clear a reclaimed block and put it where it can be reused: td's
+ * magazines, its slab, or the batch going back to the allocator.
+ */
+static void dispose_block (thread_data_t *td, void *ptr, size_t size,
+                           free_batch_t *fb)
+{
+    scrub_block(ptr, size);
+    if (g_forkscan_magazine_size > 0 && magazine_put(td, ptr, size)) {
+        return;
+    }
+    if (forkscan_slab_owns((size_t)ptr)) {
+        forkscan_slab_free(ptr);
+        return;
+    }
+    fb->ptrs[fb->n_ptrs] = ptr;
+    fb->sizes[fb->n_ptrs++] = (unsigned int)size;
+    if (FREE_BATCH_SZ == fb->n_ptrs) release_batch(fb);
+}
+
+/**
+ * Set aside a block that lives on another NUMA node for a thread there.
+ */
+static void route_block (thread_data_t *td, int node, void *ptr, size_t size)
+{
+    numa_chunk_t *chunk = td->numa_out[node];
+    if (NULL == chunk) chunk = td->numa_out[node] = forkscan_numa_chunk_new();
+    chunk->ptrs[chunk->n_ptrs] = ptr;
+    chunk->sizes[chunk->n_ptrs++] = (unsigned int)size;
+    if (NUMA_CHUNK_SZ == chunk->n_ptrs) {
+        forkscan_numa_send(node, chunk);
+        td->numa_out[node] = NULL;
+    }
+}
+
+/**
+ * Dispose of a chunk of blocks sent to td's node, or, if try_all, to any
+ * node, so blocks aren't stranded on nodes where nobody frees.  Return
+ * nonzero if there was one.
+ */
+static int receive_blocks (thread_data_t *td, int try_all, free_batch_t *fb)
+{
+    numa_chunk_t *chunk = forkscan_numa_receive(td->node);
+    int node, i;
+
+    for (node = 0; NULL == chunk && try_all && node < g_numa_nodes; ++node) {
+        chunk = forkscan_numa_receive(node);
+    }
+    if (NULL == chunk) return 0;
+    for (i = 0; i < chunk->n_ptrs; ++i) {
+        dispose_block(td, chunk->ptrs[i], chunk->sizes[i], fb);
+    }
+    __sync_fetch_and_sub(&g_dead_backlog, (long)chunk->n_ptrs);
+    forkscan_numa_chunk_release(chunk);
+    return 1;
+}
+
+/**
+ * Account for an iteration: n_retired pointers came into it and n_dead of
+ * them are now waiting to be free'd.
+ */
+void forkscan_util_pace_iteration (size_t n_retired, size_t n_dead)
+{
+    g_retires_per_iteration =
+        (3 * g_retires_per_iteration + MAX_OF(n_retired, 1)) / 4;
+    __sync_fetch_and_add(&g_dead_backlog, (long)n_dead);
+}
+
+/**
+ * Time, in ns, that a thread retiring n_retires pointers should spend
+ * free'ing.  The backlog is spread across the retires expected before the
+ * next iteration delivers more, so it drains at the rate it is refilled,
+ * but a call is never charged more than FORKSCAN_FREE_LATENCY_NS.
+ */
+size_t forkscan_util_free_budget (size_t n_retires)
+{
+    long backlog = g_dead_backlog;
+    size_t per_iteration = g_retires_per_iteration;
+    size_t frees, budget;
+
+    if (backlog <= 0) return 0;
+    frees = ((size_t)backlog * n_retires + per_iteration - 1)
+        / per_iteration;
+    budget = frees * g_ns_per_free;
+    return MIN_OF(budget, (size_t)g_forkscan_free_latency_ns);
+}
+
+/**
+ * Set the soft limit on outstanding garbage, in bytes.  0 turns memory
+ * pacing off.
+ */
+void forkscan_util_set_memory_target (size_t bytes)
+{
+    if (bytes == g_forkscan_memory_target) return;
+    g_forkscan_memory_target = bytes;
+    forkscan_util_memory_target_set();
+}
+
+/**
+ * g_forkscan_memory_target was set.  Bytes are only counted while there's
+ * a target, so start over: what was retired before is forgotten, and
+ * memory_freed() keeps its free'ing from driving the count negative.
+ */
+void forkscan_util_memory_target_set ()
+{
+    g_outstanding_bytes = 0;
+    g_unscanned_bytes = 0;
+}
+
+/**
+ * Retired bytes have been released.  Don't go below 0, since they may have
+ * been retired before the target was set.
+ */
+static void memory_freed (long bytes)
+{
+    long old, new;
+
+    do {
+        old = g_outstanding_bytes;
+        new = old > bytes ? old - bytes : 0;
+    } while (old != new
+             && !__sync_bool_compare_and_swap(&g_outstanding_bytes, old, new));
+}
+
+/**
+ * Return the size of the object behind a pointer-list value ("val").
+ */
+size_t forkscan_util_retired_size (size_t val)
+{
+    size_t code = SIZED_PTR_CODE(val);
+
+    if (code & TYPED_PTR_FLAG) {
+        return forkscan_types_get(code & ~TYPED_PTR_FLAG)->size;
+    }
+    if (code) return code << 3;
+    return USABLE_SIZE((void*)SIZED_PTR_ADDR(val));
+}
+
+/**
+ * Count bytes td just retired against the memory target.  Return
+ * MEMORY_COLLECT if enough has been retired to start an iteration,
+ * MEMORY_THROTTLE if outstanding garbage is past the hard cap, and
+ * MEMORY_OK otherwise.
+ */
+int forkscan_util_account_retire (thread_data_t *td, size_t size)
+{
+    size_t target = g_forkscan_memory_target;
+    long bytes;
+
+    if (0 == target) return MEMORY_OK;
+
+    // Small targets are counted more finely.
+    td->retired_bytes += size;
+    if (td->retired_bytes < MIN_OF(RETIRED_FLUSH_BYTES, target / 64)) {
+        return MEMORY_OK;
+    }
+    bytes = (long)td->retired_bytes;
+    td->retired_bytes = 0;
+    __sync_fetch_and_add(&g_unscanned_bytes, bytes);
+    if (__sync_add_and_fetch(&g_outstanding_bytes, bytes)
+        >= (long)(MEMORY_HARD_FACTOR * target)) {
+        return MEMORY_THROTTLE;
+    }
+    return g_unscanned_bytes >= (long)target
+        ? MEMORY_COLLECT : MEMORY_OK;
+}
+
+/**
+ * Retired memory that never went through forkscan_util_free_ptrs() (large
+ * objects) has been released.
+ */
+void forkscan_util_account_free (size_t bytes)
+{
+    if (g_forkscan_memory_target && bytes) memory_freed((long)bytes);
+}
 
-    extern int g_frees_required; // FIXME: Bad, bad, bad.
-    for (i = 0; i < g_frees_required; ++i) {
+/**
+ * The per-thread queues have been gathered up for an iteration.
+ */
+void forkscan_util_memory_collected ()
+{
+    g_unscanned_bytes = 0;
+}
+
+/**
+ * Return whether outstanding garbage is past the hard cap.
+ */
+int forkscan_util_over_memory_limit ()
+{
+    size_t target = g_forkscan_memory_target;
+    return target
+        && g_outstanding_bytes >= (long)(MEMORY_HARD_FACTOR * target);
+}
+
+/**
+ * Free retired memory for up to budget_ns.  When "finish" is set, only
+ * what's left of td's claimed range is free'd, after which td gives up its
+ * retiree buffer.
+ */
+static void free_ptrs (thread_data_t *td, size_t budget_ns, int finish)
+{
+    free_batch_t fb;
+    int numa = forkscan_numa_active();
+    size_t start, freed = 0;
+    long done = 0; // Pointers taken off of the backlog.
+    int i;
+
+    fb.n_ptrs = 0;
+    start = forkscan_util_ns();
+    if (numa && !finish) receive_blocks(td, 0, &fb);
+    for (i = 0; ; ++i) {
+        if (i > 0 && 0 == i % PACE_CHECK_INTERVAL
+            && forkscan_util_ns() - start >= budget_ns) {
+            break;
+        }
         addr_buffer_t *ab = td->retiree_buffer;
+        if (finish && (NULL == ab
+                       || td->begin_retiree_idx == td->end_retiree_idx)) {
+            // The rest of the buffer is left for other threads to claim.
+            if (ab) forkscan_buffer_unref_buffer(ab);
+            td->retiree_buffer = NULL;
+            break;
+        }
         if (NULL == ab) {
             td->retiree_buffer = forkscan_buffer_get_retiree_buffer();
             td->begin_retiree_idx = td->end_retiree_idx = 0;
+            td->shard_hint = MAX_OF(sched_getcpu(), 0);
             ab = td->retiree_buffer;
         }
-        if (NULL == ab) return; // Nothing to free.
+        if (NULL == ab) {
+            if (numa && receive_blocks(td, 1, &fb)) continue;
+            break; // Nothing to free.
+        }
 
         if (td->begin_retiree_idx == td->end_retiree_idx) {
             // Get another range to free.
-            if (ab->free_idx >= ab->n_addrs) {
+            release_batch(&fb);
+            int begin_idx, end_idx;
+            if (!forkscan_buffer_claim_range(ab, td->shard_hint,
+                                             g_forkscan_free_range,
+                                             &begin_idx, &end_idx)) {
                 // This retiree buffer is done.
                 forkscan_buffer_pop_retiree_buffer(ab);
                 forkscan_buffer_unref_buffer(ab);
                 td->retiree_buffer = NULL;
                 continue;
             }
-            int begin_idx = ab->free_idx;
-            int end_idx = MIN_OF(ab->n_addrs, begin_idx + FREE_RANGE_SZ);
-            if (BCAS(&ab->free_idx, begin_idx, end_idx)) {
-                // Success!  Got a range to free.
-                td->begin_retiree_idx = begin_idx;
-                td->end_retiree_idx = end_idx;
-            } else continue;
+            // Success!  Got a range to free.
+            td->begin_retiree_idx = td->range_base_idx = begin_idx;
+            td->end_retiree_idx = end_idx;
+            if (numa) {
+                td->node = forkscan_numa_current_node();
+                forkscan_numa_lookup(&ab->addrs[begin_idx],
+                                     end_idx - begin_idx,
+                                     td->range_nodes);
+            }
         }
 
-        size_t s = ab->addrs[td->begin_retiree_idx++];
+        int idx = td->begin_retiree_idx++;
+        size_t s = ab->addrs[idx];
+        ++done;
         if (s & 0x1) {
             // Don't free it!  It may still be alive.
             continue;
         }
         assert(0 == (s & 0x3));
-        ab->addrs[td->begin_retiree_idx - 1] = 0x2; // Remove from set.
+        ab->addrs[idx] = 0x2; // Remove from set.
+        freed += ab->sizes[idx];
         void *ptr = (void*)s;
-        // FIXME: What about this memset?  Does it save time
-        // to have it on or off?
-        memset(ptr, 0x0, MALLOC_USABLE_SIZE(ptr));
-        FREE(ptr);
+        if (forkscan_nopointers_owns(s)) {
+            // Never scanned, so stale contents can't keep anything alive.
+            forkscan_nopointers_free(ptr);
+            continue;
+        }
+        if (numa) {
+            int node = td->range_nodes[idx - td->range_base_idx];
+            if (node >= 0 && node != td->node) {
+                // It stays on the backlog until that node frees it, so
+                // its threads keep a budget to drain their inbox with.
+                --done;
+                route_block(td, node, ptr, ab->sizes[idx]);
+                continue;
+            }
+        }
+        dispose_block(td, ptr, ab->sizes[idx], &fb);
+    }
+    release_batch(&fb);
+    // Counted as they're free'd, not as ranges are claimed, so the budget
+    // stays open until the claimed ranges are finished.
+    if (done) __sync_fetch_and_sub(&g_dead_backlog, done);
+    if (g_forkscan_memory_target && freed) memory_freed((long)freed);
+    if (numa) {
+        // Don't sit on other nodes' blocks.
+        int node;
+        for (node = 0; node < g_numa_nodes; ++node) {
+            if (NULL == td->numa_out[node]) continue;
+            forkscan_numa_send(node, td->numa_out[node]);
+            td->numa_out[node] = NULL;
+        }
     }
+
+    // Most pointers are free'd, so the per-pointer cost is close enough.
+    if (i > PACE_CHECK_INTERVAL) {
+        size_t per_free = MAX_OF((forkscan_util_ns() - start) / i, 1);
+        g_ns_per_free = (7 * g_ns_per_free + per_free) / 8;
+    }
+}
+
+/**
+ * Return whether td frees retired memory for everybody.  Unless it said
+ * otherwise, that's the current APP_FREES setting -- but with no freer
+ * threads, somebody has to.
+ */
+int forkscan_util_helps_free (thread_data_t *td)
+{
+    if (td->helps_free >= 0) return td->helps_free;
+    return g_forkscan_app_frees || 0 == g_forkscan_freer_threads;
+}
+
+void forkscan_util_free_ptrs (thread_data_t *td, size_t budget_ns)
+{
+    assert(td);
+    if (0 == budget_ns || !forkscan_util_helps_free(td)) return;
+    free_ptrs(td, budget_ns, 0);
+}
+
+/**
+ * Free what's left of td's claimed range and drop its reference to the
+ * retiree buffer, for a thread that is going away.  Otherwise the range
+ * is never free'd and the buffer never released.
+ */
+void forkscan_util_finish_free (thread_data_t *td)
+{
+    assert(td);
+    if (NULL == td->retiree_buffer) return;
+    free_ptrs(td, (size_t)-1, 1);
 }
 
 /****************************************************************************/
@@ -402,6 +977,16 @@ int forkscan_util_compact (size_t *a, int length)
     return length - write;
 }
 
+/**
+ * Get a monotonic timestamp in ns.
+ */
+size_t forkscan_util_ns ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (size_t)ts.tv_sec * 1000000000 + (size_t)ts.tv_nsec;
+}
+
 /**
  * Get a timestamp in ms.
  */
@@ -422,3 +1007,5 @@ extern size_t __super_malloc_usable_size (void *);
 void *(*__forkscan_alloc) (size_t) = __super_malloc;
 void (*__forkscan_free) (void *) = __super_free;
 size_t (*__forkscan_usable_size) (void *) = __super_malloc_usable_size;
+void (*__forkscan_free_sized) (void *, size_t) = NULL; // Optional.
+void (*__forkscan_free_batch) (void **, size_t) = NULL; // Optional.
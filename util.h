@@ -26,9 +26,12 @@ THE SOFTWARE.
 #include "alloc.h"
 #include "buffer.h"
 #include "metautil.h"
+#include "nopointers.h"
+#include "numa.h"
 #include <pthread.h>
 #include "queue.h"
 #include <signal.h>
+#include "slab.h"
 
 /****************************************************************************/
 /*                         Defines, typedefs, etc.                          */
@@ -37,6 +40,17 @@ THE SOFTWARE.
 #define MALLOC(sz) __forkscan_alloc(sz)
 #define FREE(ptr) __forkscan_free(ptr)
 #define MALLOC_USABLE_SIZE(ptr) __forkscan_usable_size(ptr)
+#define FREE_SIZED(ptr, sz) (__forkscan_free_sized                    \
+                             ? __forkscan_free_sized((ptr), (sz))     \
+                             : __forkscan_free(ptr))
+
+// Usable size of anything forkscan_malloc() or forkscan_malloc_nopointers()
+// may have returned, except large objects.
+#define USABLE_SIZE(ptr) (forkscan_slab_owns((size_t)(ptr))                \
+                          ? forkscan_slab_usable_size((size_t)(ptr))       \
+                          : forkscan_nopointers_owns((size_t)(ptr))        \
+                          ? forkscan_nopointers_usable_size((size_t)(ptr)) \
+                          : MALLOC_USABLE_SIZE(ptr))
 
 #define FOREACH_IN_THREAD_LIST(td, tl) do { \
     pthread_mutex_lock(&(tl)->lock);        \
@@ -53,6 +67,38 @@ THE SOFTWARE.
 
 #define PTR_MASK(v) ((v) & ~3) // Mask off the low two bits.
 
+// What forkscan_util_account_retire() asks of the retiring thread.
+#define MEMORY_OK 0       // Nothing.
+#define MEMORY_COLLECT 1  // Start an iteration.
+#define MEMORY_THROTTLE 2 // Wait for garbage to be free'd.
+
+// While they wait in per-thread queues, retired pointers may carry a
+// 16-bit code in their unused high bits: either the object size (in 8-byte
+// units) or, with the top bit set, a type ID.  Zero means neither was given
+// and the size has to be looked up.
+#define SIZED_PTR_SHIFT 48
+#define SIZED_PTR_MAX ((size_t)0x7FFF << 3)
+#define TYPED_PTR_FLAG 0x8000
+#define SIZED_PTR(addr, size) ((size) > SIZED_PTR_MAX ? (addr)         \
+                               : (addr) | ((((size) + 7) >> 3)         \
+                                           << SIZED_PTR_SHIFT))
+#define TYPED_PTR(addr, type)                                           \
+    ((addr) | ((size_t)(TYPED_PTR_FLAG | (type)) << SIZED_PTR_SHIFT))
+#define SIZED_PTR_ADDR(v) ((v) & (((size_t)1 << SIZED_PTR_SHIFT) - 1))
+#define SIZED_PTR_CODE(v) ((v) >> SIZED_PTR_SHIFT)
+
+// Per-thread magazines cache reclaimed blocks in size classes of
+// MAGAZINE_GRANULE bytes.  A block of size n sits in class n / granule, so
+// every block in class c is at least c * granule bytes.
+#define MAGAZINE_GRANULE 16
+#define MAGAZINE_CLASSES 32
+#define MAGAZINE_PUT_CLASS(size) ((size) / MAGAZINE_GRANULE)
+#define MAGAZINE_GET_CLASS(size)                                        \
+    (((size) + MAGAZINE_GRANULE - 1) / MAGAZINE_GRANULE)
+
+// Dead pointers are claimed for free'ing this many at a time.
+#define FREE_RANGE_SZ 1024
+
 #define CACHELINESIZE ((size_t)64)
 
 #define PAGESIZE ((size_t)0x1000)
@@ -75,6 +121,8 @@ THE SOFTWARE.
 
 typedef struct free_t free_t;
 
+typedef struct magazine_t magazine_t;
+
 typedef struct thread_data_t thread_data_t;
 
 typedef struct thread_list_t thread_list_t;
@@ -87,6 +135,11 @@ struct free_t {
     free_t *next;
 };
 
+struct magazine_t {
+    free_t *head;
+    int count;
+};
+
 struct thread_data_t {
 
     // User parameters for creating a new thread.
@@ -100,24 +153,54 @@ struct thread_data_t {
     char *user_stack_high;    // Actually, just the high address to lock.
 
     int stack_is_ours;        // Whether Forkscan allocated the stack.
-    int is_active;            // The thread is running user code.
+    volatile int is_active;   // The thread is running user code.
+    pid_t tid;                // Kernel thread ID, for tgkill().
 
     queue_t ptr_list;         // Local list of pointers to be collected.
+    spill_chunk_t *spill;     // Overflow for when ptr_list is full.
 
     size_t wait_time_ms;      // reclamation time + throttling.
 
     addr_buffer_t *retiree_buffer;
     int begin_retiree_idx;
     int end_retiree_idx;
+    int range_base_idx;       // Where the range being free'd started.
+    int shard_hint;           // Retiree buffer shard to claim from first.
 
     size_t local_timestamp;
     int times_without_update;
 
     mem_range_t local_block;  // Non-stack memory local to this thread.
 
+    int helps_free;           // Frees retired memory for everybody (-1:
+                              // as g_forkscan_app_frees says).
+    size_t retired_bytes;     // Not yet counted against the memory target.
+
+    // NUMA node this thread runs on, the node of each block in the range
+    // it is free'ing, and blocks it is holding for other nodes.
+    int node;
+    signed char range_nodes[FREE_RANGE_SZ];
+    numa_chunk_t *numa_out[MAX_NUMA_NODES];
+
+    // Reclaimed blocks, by size class, for forkscan_malloc() to reuse.
+    magazine_t magazines[MAGAZINE_CLASSES];
+
     // Reference count prevents premature free'ing of the structure while
     // other threads are looking at it.
     int ref_count;
+
+    // Stop-the-world handshake: place in the relay tree, the last round
+    // this thread relayed, and, on a line of its own for the GC thread to
+    // watch, the last round it acknowledged.
+    int stw_index;
+    volatile int stw_relayed;
+    volatile int stw_ack __attribute__((aligned(64)));
+
+    // Depth of forkscan_enter_blocking() calls.  While it's non-zero the
+    // thread is left out of snapshots, and the callee-saved registers it
+    // had on entry are kept here for the scan.
+    volatile int blocking;
+    size_t blocking_regs[6];
 };
 
 struct thread_list_t {
@@ -127,18 +210,33 @@ struct thread_list_t {
 };
 
 thread_data_t *forkscan_util_thread_data_new ();
+void forkscan_util_thread_data_localize (thread_data_t *td);
 void forkscan_util_thread_data_decr_ref (thread_data_t *td);
 void forkscan_util_thread_data_free (thread_data_t *td);
-void forkscan_util_thread_data_cleanup (pthread_t tid);
+thread_data_t *forkscan_util_thread_data_unstage (pthread_t tid);
+void forkscan_util_thread_data_cleanup (thread_data_t *td);
 
 void forkscan_util_thread_list_init (thread_list_t *tl);
 void forkscan_util_thread_list_add (thread_list_t *tl, thread_data_t *td);
 void forkscan_util_thread_list_remove (thread_list_t *tl, thread_data_t *td);
 thread_data_t *forkscan_util_thread_list_find (thread_list_t *tl,
                                                size_t addr);
-void forkscan_util_push_free_list (free_t *free_list);
-free_t *forkscan_util_pop_free_list ();
-void forkscan_util_free_ptrs (thread_data_t *td);
+void forkscan_util_push_free_list (int cls, free_t *free_list, int count);
+free_t *forkscan_util_pop_free_list (int cls, int *count);
+void forkscan_util_trim ();
+void *forkscan_util_magazine_get (thread_data_t *td, size_t size);
+void forkscan_util_pace_iteration (size_t n_retired, size_t n_dead);
+void forkscan_util_set_memory_target (size_t bytes);
+void forkscan_util_memory_target_set ();
+size_t forkscan_util_retired_size (size_t val);
+int forkscan_util_account_retire (thread_data_t *td, size_t size);
+void forkscan_util_account_free (size_t bytes);
+void forkscan_util_memory_collected ();
+int forkscan_util_over_memory_limit ();
+size_t forkscan_util_free_budget (size_t n_retires);
+int forkscan_util_helps_free (thread_data_t *td);
+void forkscan_util_free_ptrs (thread_data_t *td, size_t budget_ns);
+void forkscan_util_finish_free (thread_data_t *td);
 
 /****************************************************************************/
 /*                              I/O functions.                              */
@@ -155,6 +253,11 @@ void forkscan_util_randomize (size_t *addrs, int n);
 void forkscan_util_sort (size_t *a, int length);
 int forkscan_util_compact (size_t *a, int length);
 
+/**
+ * Get a monotonic timestamp in ns.
+ */
+size_t forkscan_util_ns ();
+
 /**
  * Get a timestamp in ms.
  */
@@ -163,5 +266,7 @@ size_t forkscan_rdtsc ();
 extern void *(*__forkscan_alloc) (size_t);
 extern void (*__forkscan_free) (void *);
 extern size_t (*__forkscan_usable_size) (void *);
+extern void (*__forkscan_free_sized) (void *, size_t);
+extern void (*__forkscan_free_batch) (void **, size_t);
 
 #endif // !defined _UTIL_H_
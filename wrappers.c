@@ -27,11 +27,16 @@ THE SOFTWARE.
 #include <dlfcn.h>
 #include "env.h"
 #include "forkscan.h"
+#include "freer.h"
+#include <poll.h>
+#include "pressure.h"
 #include "proc.h"
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/epoll.h>
 #include "thread.h"
+#include <time.h>
 #include "util.h"
 
 /****************************************************************************/
@@ -56,6 +61,12 @@ typedef int (*__libc_start_main_t)(int (*) (int, char **, char **),
 
 typedef int (*main_t) (int, char **, char **);
 
+typedef int (*poll_t) (struct pollfd *, nfds_t, int);
+
+typedef int (*epoll_wait_t) (int, struct epoll_event *, int, int);
+
+typedef int (*nanosleep_t) (const struct timespec *, struct timespec *);
+
 /****************************************************************************/
 /*                                 Globals.                                 */
 /****************************************************************************/
@@ -71,6 +82,9 @@ static pthread_exit_t orig_pthread_exit;
 pthread_join_t orig_pthread_join; // Exported for use by the child.
 static __libc_start_main_t orig_libc_start_main;
 static main_t orig_main;
+static poll_t orig_poll;
+static epoll_wait_t orig_epoll_wait;
+static nanosleep_t orig_nanosleep;
 
 /****************************************************************************/
 /*                    Wrapping function implementations.                    */
@@ -185,8 +199,18 @@ __attribute__((visibility("default")))
 int pthread_join (pthread_t thread, void **retval)
 {
     assert(orig_pthread_join);
+    forkscan_thread_enter_blocking();
     int ret = orig_pthread_join(thread, retval);
-    forkscan_util_thread_data_cleanup(thread);
+    if (0 != ret) {
+        // Bad, detached, or this thread: nothing exited.
+        forkscan_thread_exit_blocking();
+        return ret;
+    }
+    // The wait for the GC thread to let go of the thread data has to be
+    // in the blocking region, or it could be waiting on us.
+    thread_data_t *td = forkscan_util_thread_data_unstage(thread);
+    forkscan_thread_exit_blocking();
+    forkscan_util_thread_data_cleanup(td);
     return ret;
 }
 
@@ -202,6 +226,7 @@ static void *main_thunk (void *arg)
 {
     int ret;
     main_args_t *main_args = (main_args_t*)arg;
+    forkscan_freer_start();
     ret = orig_main(main_args->argc, main_args->argv, main_args->env);
     if (g_forkscan_report_statistics) {
         forkscan_print_statistics();
@@ -244,12 +269,59 @@ int __libc_start_main(int (*main) (int, char **, char **),
         forkscan_fatal("Unable to start garbage collector.\n");
         // Does not return.
     }
+    if (g_forkscan_pressure
+        && 0 != orig_pthread_create(&tid, NULL, forkscan_pressure_thread,
+                                    NULL)) {
+        forkscan_diagnostic("Unable to start memory pressure watcher.\n");
+    }
 
     orig_main = main;
     return orig_libc_start_main(main_replacement, argc, ubp_av,
                                 init, fini, rtld_fini, stack_end);
 }
 
+/* With FORKSCAN_WRAP_BLOCKING set, these calls are blocking regions
+   (forkscan_enter_blocking()), so snapshots don't interrupt them. */
+
+__attribute__((visibility("default")))
+int poll (struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    int ret;
+    assert(orig_poll);
+    if (!g_forkscan_wrap_blocking) return orig_poll(fds, nfds, timeout);
+    forkscan_thread_enter_blocking();
+    ret = orig_poll(fds, nfds, timeout);
+    forkscan_thread_exit_blocking();
+    return ret;
+}
+
+__attribute__((visibility("default")))
+int epoll_wait (int epfd, struct epoll_event *events, int maxevents,
+                int timeout)
+{
+    int ret;
+    assert(orig_epoll_wait);
+    if (!g_forkscan_wrap_blocking) {
+        return orig_epoll_wait(epfd, events, maxevents, timeout);
+    }
+    forkscan_thread_enter_blocking();
+    ret = orig_epoll_wait(epfd, events, maxevents, timeout);
+    forkscan_thread_exit_blocking();
+    return ret;
+}
+
+__attribute__((visibility("default")))
+int nanosleep (const struct timespec *req, struct timespec *rem)
+{
+    int ret;
+    assert(orig_nanosleep);
+    if (!g_forkscan_wrap_blocking) return orig_nanosleep(req, rem);
+    forkscan_thread_enter_blocking();
+    ret = orig_nanosleep(req, rem);
+    forkscan_thread_exit_blocking();
+    return ret;
+}
+
 /****************************************************************************/
 /*                           Replacement routine.                           */
 /****************************************************************************/
@@ -266,4 +338,7 @@ static void do_wrapper_replacement ()
     orig_pthread_exit = dlsym(RTLD_NEXT, "pthread_exit");
     orig_pthread_join = dlsym(RTLD_NEXT, "pthread_join");
     orig_libc_start_main = dlsym(RTLD_NEXT, "__libc_start_main");
+    orig_poll = dlsym(RTLD_NEXT, "poll");
+    orig_epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+    orig_nanosleep = dlsym(RTLD_NEXT, "nanosleep");
 }